@@ -0,0 +1,1026 @@
+/* Converting Type 1 fonts to CFF */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "post.h"
+
+#define NSTACK		64	/* charstring operand stack size */
+#define NSTEMS		96	/* maximum number of stem hints */
+#define NDEPTH		16	/* maximum subroutine nesting */
+#define FIX(n)		((long) (n) * 65536)
+
+/* the first standard strings of CFF (ISOAdobe charset) */
+static char *cff_stdstr[] = {
+	".notdef", "space", "exclam", "quotedbl", "numbersign", "dollar",
+	"percent", "ampersand", "quoteright", "parenleft", "parenright",
+	"asterisk", "plus", "comma", "hyphen", "period", "slash", "zero",
+	"one", "two", "three", "four", "five", "six", "seven", "eight",
+	"nine", "colon", "semicolon", "less", "equal", "greater", "question",
+	"at", "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L",
+	"M", "N", "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y", "Z",
+	"bracketleft", "backslash", "bracketright", "asciicircum",
+	"underscore", "quoteleft", "a", "b", "c", "d", "e", "f", "g", "h",
+	"i", "j", "k", "l", "m", "n", "o", "p", "q", "r", "s", "t", "u", "v",
+	"w", "x", "y", "z", "braceleft", "bar", "braceright", "asciitilde",
+	"exclamdown", "cent", "sterling", "fraction", "yen", "florin",
+	"section", "currency", "quotesingle", "quotedblleft",
+	"guillemotleft", "guilsinglleft", "guilsinglright", "fi", "fl",
+	"endash", "dagger", "daggerdbl", "periodcentered", "paragraph",
+	"bullet", "quotesinglbase", "quotedblbase", "quotedblright",
+	"guillemotright", "ellipsis", "perthousand", "questiondown", "grave",
+	"acute", "circumflex", "tilde", "macron", "breve", "dotaccent",
+	"dieresis", "ring", "cedilla", "hungarumlaut", "ogonek", "caron",
+	"emdash", "AE", "ordfeminine", "Lslash", "Oslash", "OE",
+	"ordmasculine", "ae", "dotlessi", "lslash", "oslash", "oe",
+	"germandbls", "onesuperior", "logicalnot", "mu", "trademark", "Eth",
+	"onehalf", "plusminus", "Thorn", "onequarter", "divide", "brokenbar",
+	"degree", "thorn", "threequarters", "twosuperior", "registered",
+	"minus", "eth", "multiply", "threesuperior", "copyright", "Aacute",
+	"Acircumflex", "Adieresis", "Agrave", "Aring", "Atilde", "Ccedilla",
+	"Eacute", "Ecircumflex", "Edieresis", "Egrave", "Iacute",
+	"Icircumflex", "Idieresis", "Igrave", "Ntilde", "Oacute",
+	"Ocircumflex", "Odieresis", "Ograve", "Otilde", "Scaron", "Uacute",
+	"Ucircumflex", "Udieresis", "Ugrave", "Yacute", "Ydieresis", "Zcaron",
+	"aacute", "acircumflex", "adieresis", "agrave", "aring", "atilde",
+	"ccedilla", "eacute", "ecircumflex", "edieresis", "egrave", "iacute",
+	"icircumflex", "idieresis", "igrave", "ntilde", "oacute",
+	"ocircumflex", "odieresis", "ograve", "otilde", "scaron", "uacute",
+	"ucircumflex", "udieresis", "ugrave", "yacute", "ydieresis", "zcaron",
+};
+
+#define NSTDSTR		391	/* the number of CFF standard strings */
+
+/* a parsed Type 1 font */
+struct t1 {
+	char name[128];		/* font name */
+	int bbox[4];		/* font bounding box */
+	double mat[6];		/* font matrix */
+	int leniv;		/* the number of random charstring bytes */
+	char **subr;		/* subroutines */
+	int *subr_len;
+	int subr_n;
+	char **gname;		/* glyph names */
+	char **gcs;		/* glyph charstrings */
+	int *glen;
+	int g_n;
+	int blues[2][16];	/* BlueValues and OtherBlues */
+	int blues_n[2];
+	int stdw[2];		/* StdHW and StdVW */
+};
+
+/* a path segment or hint mask of a glyph */
+struct t1seg {
+	int op;			/* 'm', 'l', 'c', or 'h' for hint masks */
+	long a[6];		/* absolute coordinates */
+	char *mask;		/* active hints for 'h' */
+};
+
+/* charstring interpreter state */
+struct t1cs {
+	struct t1 *t1;
+	long st[NSTACK];	/* operand stack (16.16 fixed point) */
+	int sp;
+	long ps[NSTACK];	/* PostScript stack of othersubrs */
+	int psp;
+	long cx, cy;		/* current point */
+	long sbx, sby, wx;	/* side bearing and width */
+	int flex;		/* inside a flex sequence */
+	long fx[7], fy[7];	/* flex points */
+	int fn;
+	long stem[NSTEMS][2];	/* stem position and width */
+	int stemv[NSTEMS];	/* vertical stems */
+	int stem_n;
+	char act[NSTEMS];	/* active stems */
+	int actdirty;		/* active stems changed */
+	int replaced;		/* hint replacement was used */
+	struct t1seg *seg;	/* glyph path */
+	int seg_n, seg_sz;
+	int seac[4];		/* seac arguments */
+	int isseac;
+	int ended;
+};
+
+static int t1_ws(int c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\0';
+}
+
+/* read the next token of s at *pos into tok */
+static int t1_tok(char *s, int len, int *pos, char *tok, int toklen)
+{
+	int i = 0;
+	while (*pos < len && t1_ws((unsigned char) s[*pos]))
+		(*pos)++;
+	if (*pos >= len)
+		return 1;
+	if (strchr("[]{}", s[*pos])) {
+		tok[i++] = s[(*pos)++];
+	} else {
+		while (*pos < len && !t1_ws((unsigned char) s[*pos]) &&
+				!strchr("[]{}", s[*pos])) {
+			if (i < toklen - 1)
+				tok[i++] = s[*pos];
+			(*pos)++;
+		}
+	}
+	tok[i] = '\0';
+	return 0;
+}
+
+/* decrypt eexec or charstring data in place */
+static void t1_decrypt(char *d, int n, unsigned r)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		int c = (unsigned char) d[i];
+		d[i] = c ^ (r >> 8);
+		r = ((c + r) * 52845 + 22719) & 0xffff;
+	}
+}
+
+/* read a charstring following RD; returns a malloc'd decrypted copy */
+static char *t1_blob(struct t1 *t1, char *s, int len, int *pos, int n, int *blen)
+{
+	char tok[64];
+	char *d;
+	if (t1_tok(s, len, pos, tok, sizeof(tok)) || n < 0)
+		return NULL;
+	(*pos)++;
+	if (*pos + n > len)
+		return NULL;
+	d = malloc(n + 1);
+	memcpy(d, s + *pos, n);
+	*pos += n;
+	*blen = n;
+	if (t1->leniv >= 0) {
+		t1_decrypt(d, n, 4330);
+		*blen = MAX(0, n - t1->leniv);
+		memmove(d, d + MIN(n, t1->leniv), *blen);
+	}
+	return d;
+}
+
+/* read integers of an array */
+static int t1_ints(char *s, int len, int *pos, int *d, int n)
+{
+	char tok[64];
+	int i = 0;
+	if (t1_tok(s, len, pos, tok, sizeof(tok)) || !strchr("[{", tok[0]))
+		return 0;
+	while (!t1_tok(s, len, pos, tok, sizeof(tok)) && !strchr("]}", tok[0]))
+		if (i < n)
+			d[i++] = atoi(tok);
+	return i;
+}
+
+/* parse the decrypted private part of a Type 1 font */
+static int t1_private(struct t1 *t1, char *s, int len)
+{
+	char tok[128];
+	int pos = 0;
+	int subr_cnt = -1, glyph_cnt = -1;
+	int i;
+	while (!t1_tok(s, len, &pos, tok, sizeof(tok))) {
+		if (!strcmp("/lenIV", tok) && !t1_tok(s, len, &pos, tok, sizeof(tok)))
+			t1->leniv = atoi(tok);
+		if (!strcmp("/BlueValues", tok))
+			t1->blues_n[0] = t1_ints(s, len, &pos, t1->blues[0], 14);
+		if (!strcmp("/OtherBlues", tok))
+			t1->blues_n[1] = t1_ints(s, len, &pos, t1->blues[1], 10);
+		if (!strcmp("/StdHW", tok))
+			t1_ints(s, len, &pos, &t1->stdw[0], 1);
+		if (!strcmp("/StdVW", tok))
+			t1_ints(s, len, &pos, &t1->stdw[1], 1);
+		if (!strcmp("/Subrs", tok) && !t1_tok(s, len, &pos, tok, sizeof(tok))) {
+			subr_cnt = MAX(0, atoi(tok));
+			t1->subr = calloc(subr_cnt + 1, sizeof(t1->subr[0]));
+			t1->subr_len = calloc(subr_cnt + 1, sizeof(t1->subr_len[0]));
+			t1->subr_n = subr_cnt;
+			for (i = 0; i < subr_cnt; ) {
+				int idx, n;
+				if (t1_tok(s, len, &pos, tok, sizeof(tok)))
+					return 1;
+				if (strcmp("dup", tok))
+					continue;
+				if (t1_tok(s, len, &pos, tok, sizeof(tok)))
+					return 1;
+				idx = atoi(tok);
+				if (t1_tok(s, len, &pos, tok, sizeof(tok)))
+					return 1;
+				n = atoi(tok);
+				if (idx < 0 || idx >= subr_cnt || t1->subr[idx])
+					return 1;
+				t1->subr[idx] = t1_blob(t1, s, len, &pos, n, &t1->subr_len[idx]);
+				if (!t1->subr[idx])
+					return 1;
+				i++;
+			}
+		}
+		if (!strcmp("/CharStrings", tok) && !t1_tok(s, len, &pos, tok, sizeof(tok))) {
+			glyph_cnt = MAX(0, atoi(tok));
+			t1->gname = calloc(glyph_cnt + 1, sizeof(t1->gname[0]));
+			t1->gcs = calloc(glyph_cnt + 1, sizeof(t1->gcs[0]));
+			t1->glen = calloc(glyph_cnt + 1, sizeof(t1->glen[0]));
+			while (t1->g_n < glyph_cnt) {
+				int n, g = t1->g_n;
+				if (t1_tok(s, len, &pos, tok, sizeof(tok)))
+					break;
+				if (tok[0] != '/')
+					continue;
+				t1->gname[g] = malloc(strlen(tok));
+				strcpy(t1->gname[g], tok + 1);
+				if (t1_tok(s, len, &pos, tok, sizeof(tok)))
+					return 1;
+				n = atoi(tok);
+				if (!(t1->gcs[g] = t1_blob(t1, s, len, &pos, n, &t1->glen[g])))
+					return 1;
+				t1->g_n++;
+			}
+			break;
+		}
+	}
+	return glyph_cnt < 0;
+}
+
+/* parse a Type 1 font, in PFA, PFB, or raw binary format */
+static int t1_parse(struct t1 *t1, char *t1dat, int len)
+{
+	struct sbuf *sb = NULL;
+	char tok[128];
+	char *s = t1dat;
+	char *priv;
+	int pos = 0, beg, plen;
+	int ret;
+	int i;
+	/* concatenating PFB segments */
+	if (len > 6 && (unsigned char) s[0] == 0x80) {
+		sb = sbuf_make();
+		while (pos + 6 <= len && (unsigned char) s[pos] == 0x80 &&
+				(s[pos + 1] == 1 || s[pos + 1] == 2)) {
+			unsigned char *u = (void *) (s + pos + 2);
+			int n = u[0] | (u[1] << 8) | (u[2] << 16) | (u[3] << 24);
+			if (n < 0 || pos + 6 + n > len)
+				break;
+			sbuf_mem(sb, s + pos + 6, n);
+			pos += 6 + n;
+		}
+		s = sbuf_buf(sb);
+		len = sbuf_len(sb);
+		pos = 0;
+	}
+	t1->leniv = 4;
+	t1->mat[0] = 0.001;
+	t1->mat[3] = 0.001;
+	/* the clear-text portion */
+	while (!t1_tok(s, len, &pos, tok, sizeof(tok))) {
+		if (!strcmp("eexec", tok))
+			break;
+		if (!strcmp("/FontName", tok) && !t1_tok(s, len, &pos, tok, sizeof(tok)))
+			snprintf(t1->name, sizeof(t1->name), "%s", tok + (tok[0] == '/'));
+		if (!strcmp("/FontBBox", tok))
+			t1_ints(s, len, &pos, t1->bbox, 4);
+		if (!strcmp("/FontMatrix", tok) && !t1_tok(s, len, &pos, tok, sizeof(tok))) {
+			for (i = 0; i < 6 && !t1_tok(s, len, &pos, tok, sizeof(tok)); i++)
+				t1->mat[i] = atof(tok);
+		}
+	}
+	while (pos < len && t1_ws((unsigned char) s[pos]))
+		pos++;
+	if (pos + 4 > len) {
+		sbuf_free(sb);
+		return 1;
+	}
+	/* the encrypted portion; hexadecimal or binary */
+	beg = pos;
+	for (i = 0; i < 4; i++)
+		if (!isxdigit((unsigned char) s[beg + i]))
+			break;
+	priv = malloc(len - beg + 1);
+	plen = 0;
+	if (i == 4) {
+		int d = -1;
+		for (i = beg; i < len; i++) {
+			int c = tolower((unsigned char) s[i]);
+			if (t1_ws(c))
+				continue;
+			if (!isxdigit(c))
+				break;
+			c = isdigit(c) ? c - '0' : c - 'a' + 10;
+			if (d < 0) {
+				d = c;
+			} else {
+				priv[plen++] = d * 16 + c;
+				d = -1;
+			}
+		}
+	} else {
+		memcpy(priv, s + beg, len - beg);
+		plen = len - beg;
+	}
+	t1_decrypt(priv, plen, 55665);
+	ret = plen < 4 || t1_private(t1, priv + 4, plen - 4);
+	free(priv);
+	if (sb)
+		sbuf_free(sb);
+	return ret;
+}
+
+static void t1_free(struct t1 *t1)
+{
+	int i;
+	for (i = 0; i < t1->subr_n; i++)
+		free(t1->subr[i]);
+	for (i = 0; i < t1->g_n; i++) {
+		free(t1->gname[i]);
+		free(t1->gcs[i]);
+	}
+	free(t1->subr);
+	free(t1->subr_len);
+	free(t1->gname);
+	free(t1->gcs);
+	free(t1->glen);
+}
+
+static struct t1seg *cs_seg(struct t1cs *cs, int op)
+{
+	struct t1seg *seg;
+	if (cs->actdirty && cs->stem_n) {
+		if (cs->seg_n == cs->seg_sz) {
+			cs->seg_sz += 64;
+			cs->seg = mextend(cs->seg, cs->seg_n, cs->seg_sz, sizeof(cs->seg[0]));
+		}
+		seg = &cs->seg[cs->seg_n++];
+		seg->op = 'h';
+		seg->mask = malloc(NSTEMS);
+		memcpy(seg->mask, cs->act, NSTEMS);
+	}
+	cs->actdirty = 0;
+	if (cs->seg_n == cs->seg_sz) {
+		cs->seg_sz += 64;
+		cs->seg = mextend(cs->seg, cs->seg_n, cs->seg_sz, sizeof(cs->seg[0]));
+	}
+	seg = &cs->seg[cs->seg_n++];
+	seg->op = op;
+	return seg;
+}
+
+static void cs_moveto(struct t1cs *cs, long dx, long dy)
+{
+	struct t1seg *seg;
+	cs->cx += dx;
+	cs->cy += dy;
+	if (cs->flex) {
+		if (cs->fn < 7) {
+			cs->fx[cs->fn] = cs->cx;
+			cs->fy[cs->fn] = cs->cy;
+			cs->fn++;
+		}
+		return;
+	}
+	seg = cs_seg(cs, 'm');
+	seg->a[0] = cs->cx;
+	seg->a[1] = cs->cy;
+}
+
+static void cs_lineto(struct t1cs *cs, long dx, long dy)
+{
+	struct t1seg *seg = cs_seg(cs, 'l');
+	cs->cx += dx;
+	cs->cy += dy;
+	seg->a[0] = cs->cx;
+	seg->a[1] = cs->cy;
+}
+
+static void cs_curveto(struct t1cs *cs, long dx1, long dy1,
+		long dx2, long dy2, long dx3, long dy3)
+{
+	struct t1seg *seg = cs_seg(cs, 'c');
+	seg->a[0] = cs->cx + dx1;
+	seg->a[1] = cs->cy + dy1;
+	seg->a[2] = seg->a[0] + dx2;
+	seg->a[3] = seg->a[1] + dy2;
+	seg->a[4] = seg->a[2] + dx3;
+	seg->a[5] = seg->a[3] + dy3;
+	cs->cx = seg->a[4];
+	cs->cy = seg->a[5];
+}
+
+static void cs_stem(struct t1cs *cs, int vert, long pos, long wid)
+{
+	int i;
+	pos += vert ? cs->sbx : cs->sby;
+	for (i = 0; i < cs->stem_n; i++)
+		if (cs->stemv[i] == vert && cs->stem[i][0] == pos && cs->stem[i][1] == wid)
+			break;
+	if (i == cs->stem_n) {
+		if (cs->stem_n == NSTEMS)
+			return;
+		cs->stemv[i] = vert;
+		cs->stem[i][0] = pos;
+		cs->stem[i][1] = wid;
+		cs->stem_n++;
+	}
+	if (!cs->act[i])
+		cs->actdirty = 1;
+	cs->act[i] = 1;
+}
+
+static void cs_othersubr(struct t1cs *cs, int idx, long *args, int n)
+{
+	int i;
+	switch (idx) {
+	case 0:			/* end of flex */
+		if (cs->flex && cs->fn == 7) {
+			for (i = 1; i < 7; i += 3) {
+				struct t1seg *seg = cs_seg(cs, 'c');
+				seg->a[0] = cs->fx[i];
+				seg->a[1] = cs->fy[i];
+				seg->a[2] = cs->fx[i + 1];
+				seg->a[3] = cs->fy[i + 1];
+				seg->a[4] = cs->fx[i + 2];
+				seg->a[5] = cs->fy[i + 2];
+			}
+		}
+		cs->flex = 0;
+		cs->ps[cs->psp++] = cs->cy;
+		cs->ps[cs->psp++] = cs->cx;
+		break;
+	case 1:			/* start of flex */
+		cs->flex = 1;
+		cs->fn = 0;
+		break;
+	case 2:			/* flex point; recorded by rmoveto */
+		break;
+	case 3:			/* hint replacement */
+		memset(cs->act, 0, sizeof(cs->act));
+		cs->actdirty = 1;
+		cs->replaced = 1;
+		cs->ps[cs->psp++] = n > 0 ? args[0] : FIX(3);
+		break;
+	default:
+		for (i = n - 1; i >= 0; i--)
+			cs->ps[cs->psp++] = args[i];
+	}
+}
+
+/* interpret a Type 1 charstring */
+static int cs_run(struct t1cs *cs, unsigned char *s, int len, int depth)
+{
+	long *st = cs->st;
+	int i = 0;
+	if (depth > NDEPTH)
+		return 1;
+	while (i < len && !cs->ended) {
+		int c = s[i++];
+		long v;
+		if (c >= 32) {
+			if (c <= 246) {
+				v = c - 139;
+			} else if (c <= 250) {
+				if (i >= len)
+					return 1;
+				v = (c - 247) * 256 + s[i++] + 108;
+			} else if (c <= 254) {
+				if (i >= len)
+					return 1;
+				v = -(c - 251) * 256 - s[i++] - 108;
+			} else {
+				if (i + 4 > len)
+					return 1;
+				v = (long) (int) (((unsigned) s[i] << 24) | (s[i + 1] << 16) |
+						(s[i + 2] << 8) | s[i + 3]);
+				i += 4;
+			}
+			if (cs->sp >= NSTACK)
+				return 1;
+			st[cs->sp++] = FIX(v);
+			continue;
+		}
+		if (c == 12) {
+			if (i >= len)
+				return 1;
+			c = 32 + s[i++];
+		}
+		switch (c) {
+		case 1:			/* hstem */
+		case 3:			/* vstem */
+			if (cs->sp >= 2)
+				cs_stem(cs, c == 3, st[0], st[1]);
+			break;
+		case 32 + 1:		/* vstem3 */
+		case 32 + 2:		/* hstem3 */
+			if (cs->sp >= 6)
+				for (v = 0; v < 6; v += 2)
+					cs_stem(cs, c == 32 + 1, st[v], st[v + 1]);
+			break;
+		case 4:			/* vmoveto */
+			if (cs->sp >= 1)
+				cs_moveto(cs, 0, st[cs->sp - 1]);
+			break;
+		case 21:		/* rmoveto */
+			if (cs->sp >= 2)
+				cs_moveto(cs, st[cs->sp - 2], st[cs->sp - 1]);
+			break;
+		case 22:		/* hmoveto */
+			if (cs->sp >= 1)
+				cs_moveto(cs, st[cs->sp - 1], 0);
+			break;
+		case 5:			/* rlineto */
+			if (cs->sp >= 2)
+				cs_lineto(cs, st[0], st[1]);
+			break;
+		case 6:			/* hlineto */
+			if (cs->sp >= 1)
+				cs_lineto(cs, st[0], 0);
+			break;
+		case 7:			/* vlineto */
+			if (cs->sp >= 1)
+				cs_lineto(cs, 0, st[0]);
+			break;
+		case 8:			/* rrcurveto */
+			if (cs->sp >= 6)
+				cs_curveto(cs, st[0], st[1], st[2], st[3], st[4], st[5]);
+			break;
+		case 30:		/* vhcurveto */
+			if (cs->sp >= 4)
+				cs_curveto(cs, 0, st[0], st[1], st[2], st[3], 0);
+			break;
+		case 31:		/* hvcurveto */
+			if (cs->sp >= 4)
+				cs_curveto(cs, st[0], 0, st[1], st[2], 0, st[3]);
+			break;
+		case 9:			/* closepath */
+		case 32 + 0:		/* dotsection */
+			break;
+		case 10:		/* callsubr */
+			if (cs->sp < 1)
+				return 1;
+			v = st[--cs->sp] >> 16;
+			if (v < 0 || v >= cs->t1->subr_n || !cs->t1->subr[v])
+				return 1;
+			if (cs_run(cs, (void *) cs->t1->subr[v], cs->t1->subr_len[v], depth + 1))
+				return 1;
+			continue;
+		case 11:		/* return */
+			return 0;
+		case 13:		/* hsbw */
+			if (cs->sp >= 2) {
+				cs->sbx = st[0];
+				cs->wx = st[1];
+				cs->cx = cs->sbx;
+				cs->cy = 0;
+			}
+			break;
+		case 32 + 7:		/* sbw */
+			if (cs->sp >= 4) {
+				cs->sbx = st[0];
+				cs->sby = st[1];
+				cs->wx = st[2];
+				cs->cx = cs->sbx;
+				cs->cy = cs->sby;
+			}
+			break;
+		case 14:		/* endchar */
+			cs->ended = 1;
+			break;
+		case 32 + 6:		/* seac */
+			if (cs->sp >= 5) {
+				cs->seac[0] = (st[1] - st[0] + cs->sbx) >> 16;
+				cs->seac[1] = st[2] >> 16;
+				cs->seac[2] = st[3] >> 16;
+				cs->seac[3] = st[4] >> 16;
+				cs->isseac = 1;
+			}
+			cs->ended = 1;
+			break;
+		case 32 + 12:		/* div */
+			if (cs->sp < 2 || !st[cs->sp - 1])
+				return 1;
+			st[cs->sp - 2] = (long) ((double) st[cs->sp - 2] /
+					st[cs->sp - 1] * 65536);
+			cs->sp--;
+			continue;
+		case 32 + 16:		/* callothersubr */
+			if (cs->sp >= 2) {
+				int idx = st[cs->sp - 1] >> 16;
+				int n = st[cs->sp - 2] >> 16;
+				if (n < 0 || n > cs->sp - 2 || cs->psp + n + 2 > NSTACK)
+					return 1;
+				cs->sp -= 2 + n;
+				cs_othersubr(cs, idx, st + cs->sp, n);
+			}
+			continue;
+		case 32 + 17:		/* pop */
+			if (cs->sp < NSTACK)
+				st[cs->sp++] = cs->psp > 0 ? cs->ps[--cs->psp] : 0;
+			continue;
+		case 32 + 33:		/* setcurrentpoint */
+			if (cs->sp >= 2) {
+				cs->cx = st[cs->sp - 2];
+				cs->cy = st[cs->sp - 1];
+			}
+			break;
+		default:
+			return 1;
+		}
+		cs->sp = 0;
+	}
+	return 0;
+}
+
+/* append a Type 2 charstring number */
+static void t2_num(struct sbuf *sb, long v)
+{
+	long n = v >> 16;
+	if (v & 0xffff) {
+		sbuf_chr(sb, 255);
+		sbuf_chr(sb, (v >> 24) & 0xff);
+		sbuf_chr(sb, (v >> 16) & 0xff);
+		sbuf_chr(sb, (v >> 8) & 0xff);
+		sbuf_chr(sb, v & 0xff);
+	} else if (n >= -107 && n <= 107) {
+		sbuf_chr(sb, n + 139);
+	} else if (n >= 108 && n <= 1131) {
+		sbuf_chr(sb, (n - 108) / 256 + 247);
+		sbuf_chr(sb, (n - 108) % 256);
+	} else if (n >= -1131 && n <= -108) {
+		sbuf_chr(sb, (-n - 108) / 256 + 251);
+		sbuf_chr(sb, (-n - 108) % 256);
+	} else {
+		sbuf_chr(sb, 28);
+		sbuf_chr(sb, (n >> 8) & 0xff);
+		sbuf_chr(sb, n & 0xff);
+	}
+}
+
+/* write the stem hints of one direction */
+static void t2_stems(struct sbuf *sb, struct t1cs *cs, int *ord, int vert, int op)
+{
+	long last = 0;
+	int n = 0;
+	int i;
+	for (i = 0; i < cs->stem_n; i++) {
+		if (cs->stemv[ord[i]] != vert)
+			continue;
+		t2_num(sb, cs->stem[ord[i]][0] - last);
+		t2_num(sb, cs->stem[ord[i]][1]);
+		last = cs->stem[ord[i]][0] + cs->stem[ord[i]][1];
+		if (++n % 23 == 0) {
+			sbuf_chr(sb, op);
+			last = 0;
+		}
+	}
+	if (n % 23)
+		sbuf_chr(sb, op);
+}
+
+static struct t1cs *cs_sort;
+
+static int stemcmp(const void *v1, const void *v2)
+{
+	int i1 = *(int *) v1, i2 = *(int *) v2;
+	if (cs_sort->stemv[i1] != cs_sort->stemv[i2])
+		return cs_sort->stemv[i1] - cs_sort->stemv[i2];
+	if (cs_sort->stem[i1][0] != cs_sort->stem[i2][0])
+		return cs_sort->stem[i1][0] < cs_sort->stem[i2][0] ? -1 : 1;
+	return i1 - i2;
+}
+
+/* convert the interpreted glyph to a Type 2 charstring */
+static void t2_glyph(struct sbuf *sb, struct t1cs *cs)
+{
+	int ord[NSTEMS];
+	long x = 0, y = 0;
+	int width = 1;		/* width should be written */
+	int op = 0, nargs = 0;	/* the last path operator and its arguments */
+	int i, j;
+	for (i = 0; i < cs->stem_n; i++)
+		ord[i] = i;
+	cs_sort = cs;
+	qsort(ord, cs->stem_n, sizeof(ord[0]), stemcmp);
+	if (cs->stem_n) {
+		t2_num(sb, cs->wx);
+		width = 0;
+		t2_stems(sb, cs, ord, 0, cs->replaced ? 18 : 1);
+		t2_stems(sb, cs, ord, 1, cs->replaced ? 23 : 3);
+	}
+	for (i = 0; i < cs->seg_n; i++) {
+		struct t1seg *seg = &cs->seg[i];
+		int nx = seg->op == 'c' ? 6 : 2;
+		if (seg->op == 'm' && (i + 1 == cs->seg_n || cs->seg[i + 1].op == 'm'))
+			continue;
+		if (op && (op != seg->op || nargs + nx > 48)) {
+			sbuf_chr(sb, op == 'l' ? 5 : 8);
+			op = 0;
+			nargs = 0;
+		}
+		if (seg->op == 'h') {
+			if (cs->replaced) {
+				sbuf_chr(sb, 19);
+				for (j = 0; j < (cs->stem_n + 7) / 8 * 8; j += 8) {
+					int m = 0, k;
+					for (k = 0; k < 8; k++)
+						if (j + k < cs->stem_n && seg->mask[ord[j + k]])
+							m |= 0x80 >> k;
+					sbuf_chr(sb, m);
+				}
+			}
+			continue;
+		}
+		if (seg->op == 'm' && width) {
+			t2_num(sb, cs->wx);
+			width = 0;
+		}
+		for (j = 0; j < nx; j += 2) {
+			t2_num(sb, seg->a[j] - x);
+			t2_num(sb, seg->a[j + 1] - y);
+			x = seg->a[j];
+			y = seg->a[j + 1];
+		}
+		if (seg->op == 'm') {
+			sbuf_chr(sb, 21);
+		} else {
+			op = seg->op;
+			nargs += nx;
+		}
+	}
+	if (op)
+		sbuf_chr(sb, op == 'l' ? 5 : 8);
+	if (width)
+		t2_num(sb, cs->wx);
+	if (cs->isseac)
+		for (i = 0; i < 4; i++)
+			t2_num(sb, FIX(cs->seac[i]));
+	sbuf_chr(sb, 14);
+}
+
+/* convert a Type 1 charstring to Type 2 */
+static int t1_conv(struct t1 *t1, int g, struct sbuf *sb)
+{
+	struct t1cs *cs = calloc(1, sizeof(*cs));
+	int ret, i;
+	cs->t1 = t1;
+	ret = cs_run(cs, (void *) t1->gcs[g], t1->glen[g], 0);
+	if (!ret)
+		t2_glyph(sb, cs);
+	for (i = 0; i < cs->seg_n; i++)
+		if (cs->seg[i].op == 'h')
+			free(cs->seg[i].mask);
+	free(cs->seg);
+	free(cs);
+	return ret;
+}
+
+/* append a CFF DICT integer */
+static void cff_int(struct sbuf *sb, long n)
+{
+	if (n >= -107 && n <= 107) {
+		sbuf_chr(sb, n + 139);
+	} else if (n >= 108 && n <= 1131) {
+		sbuf_chr(sb, (n - 108) / 256 + 247);
+		sbuf_chr(sb, (n - 108) % 256);
+	} else if (n >= -1131 && n <= -108) {
+		sbuf_chr(sb, (-n - 108) / 256 + 251);
+		sbuf_chr(sb, (-n - 108) % 256);
+	} else if (n >= -32768 && n <= 32767) {
+		sbuf_chr(sb, 28);
+		sbuf_chr(sb, (n >> 8) & 0xff);
+		sbuf_chr(sb, n & 0xff);
+	} else {
+		sbuf_chr(sb, 29);
+		sbuf_chr(sb, (n >> 24) & 0xff);
+		sbuf_chr(sb, (n >> 16) & 0xff);
+		sbuf_chr(sb, (n >> 8) & 0xff);
+		sbuf_chr(sb, n & 0xff);
+	}
+}
+
+/* append a CFF DICT offset; always five bytes */
+static void cff_off(struct sbuf *sb, long n)
+{
+	sbuf_chr(sb, 29);
+	sbuf_chr(sb, (n >> 24) & 0xff);
+	sbuf_chr(sb, (n >> 16) & 0xff);
+	sbuf_chr(sb, (n >> 8) & 0xff);
+	sbuf_chr(sb, n & 0xff);
+}
+
+/* append a CFF DICT real number */
+static void cff_real(struct sbuf *sb, double d)
+{
+	char buf[64];
+	char nib[64];
+	int n = 0;
+	char *s = buf;
+	int i;
+	snprintf(buf, sizeof(buf), "%g", d);
+	for (; *s && n < sizeof(nib) - 2; s++) {
+		if (isdigit((unsigned char) *s))
+			nib[n++] = *s - '0';
+		if (*s == '.')
+			nib[n++] = 0xa;
+		if (*s == '-' && s == buf)
+			nib[n++] = 0xe;
+		if (*s == 'e')
+			nib[n++] = s[1] == '-' ? 0xc : 0xb;
+	}
+	nib[n++] = 0xf;
+	if (n & 1)
+		nib[n++] = 0xf;
+	sbuf_chr(sb, 30);
+	for (i = 0; i < n; i += 2)
+		sbuf_chr(sb, (nib[i] << 4) | nib[i + 1]);
+}
+
+/* append a CFF INDEX */
+static void cff_index(struct sbuf *sb, char **dat, int *len, int n)
+{
+	long tot = 1;
+	int offsz = 1;
+	int i, j;
+	sbuf_chr(sb, (n >> 8) & 0xff);
+	sbuf_chr(sb, n & 0xff);
+	if (!n)
+		return;
+	for (i = 0; i < n; i++)
+		tot += len[i];
+	while (offsz < 4 && tot >= (1l << (offsz * 8)))
+		offsz++;
+	sbuf_chr(sb, offsz);
+	tot = 1;
+	for (i = 0; i <= n; i++) {
+		for (j = offsz - 1; j >= 0; j--)
+			sbuf_chr(sb, (tot >> (j * 8)) & 0xff);
+		if (i < n)
+			tot += len[i];
+	}
+	for (i = 0; i < n; i++)
+		sbuf_mem(sb, dat[i], len[i]);
+}
+
+/* the standard string identifier of s or -1 */
+static int cff_sid(char *s)
+{
+	int i;
+	for (i = 0; i < LEN(cff_stdstr); i++)
+		if (!strcmp(cff_stdstr[i], s))
+			return i;
+	return -1;
+}
+
+/* the top DICT; offsets are charset, charstrings, private size and offset */
+static void cff_top(struct sbuf *sb, struct t1 *t1, long *off)
+{
+	static double defmat[6] = {0.001, 0, 0, 0.001, 0, 0};
+	int i;
+	if (memcmp(t1->mat, defmat, sizeof(defmat))) {
+		for (i = 0; i < 6; i++)
+			cff_real(sb, t1->mat[i]);
+		sbuf_chr(sb, 12);
+		sbuf_chr(sb, 7);
+	}
+	for (i = 0; i < 4; i++)
+		cff_int(sb, t1->bbox[i]);
+	sbuf_chr(sb, 5);
+	cff_off(sb, off[0]);
+	sbuf_chr(sb, 15);
+	cff_off(sb, off[1]);
+	sbuf_chr(sb, 17);
+	cff_off(sb, off[2]);
+	cff_off(sb, off[3]);
+	sbuf_chr(sb, 18);
+}
+
+/* the private DICT */
+static void cff_private(struct sbuf *sb, struct t1 *t1)
+{
+	int i, j;
+	for (i = 0; i < 2; i++) {
+		if (t1->blues_n[i] && !(t1->blues_n[i] & 1)) {
+			for (j = 0; j < t1->blues_n[i]; j++)
+				cff_int(sb, t1->blues[i][j] - (j ? t1->blues[i][j - 1] : 0));
+			sbuf_chr(sb, 6 + i);
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		if (t1->stdw[i]) {
+			cff_int(sb, t1->stdw[i]);
+			sbuf_chr(sb, 10 + i);
+		}
+	}
+}
+
+/*
+ * convert a Type 1 font to a bare CFF font program
+ *
+ * Subroutines are expanded in place and hint replacement is
+ * translated to hintmask operators.  Returns nonzero on failure.
+ */
+int cff_type1(char *t1dat, int len, struct sbuf *cff)
+{
+	struct t1 t1 = {{0}};
+	struct sbuf *names, *top, *strs, *cset, *chars, *priv, *idx;
+	char **cs;		/* converted charstrings */
+	int *cs_len;
+	char **str;		/* non-standard strings */
+	int *str_len;
+	int str_n = 0;
+	int *ord;		/* glyph order; .notdef comes first */
+	int n, i, j;
+	char *s;
+	int slen;
+	long off[4] = {0};
+	if (t1_parse(&t1, t1dat, len) || !t1.g_n || !t1.name[0]) {
+		t1_free(&t1);
+		return 1;
+	}
+	ord = malloc((t1.g_n + 1) * sizeof(ord[0]));
+	cs = calloc(t1.g_n + 1, sizeof(cs[0]));
+	cs_len = calloc(t1.g_n + 1, sizeof(cs_len[0]));
+	str = calloc(t1.g_n + 1, sizeof(str[0]));
+	str_len = calloc(t1.g_n + 1, sizeof(str_len[0]));
+	ord[0] = -1;
+	for (i = 0, n = 1; i < t1.g_n; i++) {
+		if (!strcmp(".notdef", t1.gname[i]))
+			ord[0] = i;
+		else
+			ord[n++] = i;
+	}
+	cset = sbuf_make();
+	sbuf_chr(cset, 0);
+	for (i = 0; i < n; i++) {
+		struct sbuf *sb = sbuf_make();
+		if (ord[i] < 0) {
+			sbuf_chr(sb, 139);
+			sbuf_chr(sb, 14);
+		} else if (t1_conv(&t1, ord[i], sb)) {
+			sbuf_free(sb);
+			break;
+		}
+		cs_len[i] = sbuf_len(sb);
+		cs[i] = sbuf_done(sb);
+		if (i > 0) {
+			int sid = cff_sid(t1.gname[ord[i]]);
+			if (sid < 0) {
+				sid = NSTDSTR + str_n;
+				str[str_n] = t1.gname[ord[i]];
+				str_len[str_n++] = strlen(t1.gname[ord[i]]);
+			}
+			sbuf_chr(cset, sid >> 8);
+			sbuf_chr(cset, sid & 0xff);
+		}
+	}
+	if (i == n) {
+		names = sbuf_make();
+		s = t1.name;
+		slen = strlen(t1.name);
+		cff_index(names, &s, &slen, 1);
+		strs = sbuf_make();
+		cff_index(strs, str, str_len, str_n);
+		cff_index(strs, NULL, NULL, 0);		/* global subrs */
+		chars = sbuf_make();
+		cff_index(chars, cs, cs_len, n);
+		priv = sbuf_make();
+		cff_private(priv, &t1);
+		/* the size of the top DICT does not depend on the offsets */
+		top = sbuf_make();
+		cff_top(top, &t1, off);
+		s = sbuf_buf(top);
+		slen = sbuf_len(top);
+		idx = sbuf_make();
+		cff_index(idx, &s, &slen, 1);
+		off[0] = 4 + sbuf_len(names) + sbuf_len(idx) + sbuf_len(strs);
+		sbuf_free(idx);
+		off[1] = off[0] + sbuf_len(cset);
+		off[2] = sbuf_len(priv);
+		off[3] = off[1] + sbuf_len(chars);
+		sbuf_free(top);
+		top = sbuf_make();
+		cff_top(top, &t1, off);
+		s = sbuf_done(top);
+		sbuf_mem(cff, "\1\0\4\4", 4);
+		sbuf_mem(cff, sbuf_buf(names), sbuf_len(names));
+		cff_index(cff, &s, &slen, 1);
+		sbuf_mem(cff, sbuf_buf(strs), sbuf_len(strs));
+		sbuf_mem(cff, sbuf_buf(cset), sbuf_len(cset));
+		sbuf_mem(cff, sbuf_buf(chars), sbuf_len(chars));
+		sbuf_mem(cff, sbuf_buf(priv), sbuf_len(priv));
+		free(s);
+		sbuf_free(names);
+		sbuf_free(strs);
+		sbuf_free(chars);
+		sbuf_free(priv);
+	}
+	j = i;
+	for (i = 0; i < n; i++)
+		free(cs[i]);
+	sbuf_free(cset);
+	free(cs);
+	free(cs_len);
+	free(str);
+	free(str_len);
+	free(ord);
+	t1_free(&t1);
+	return j != n;
+}
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# Check the cross-reference sections of large PDF files written by
+# neatpost's pdf; "-d offset=n" makes pdf number its output as if it
+# started at offset n of the file.  This option exists only for this
+# script: the offsets in its output are wrong for a standalone file.
+# Usage: python3 check.py [./pdf]
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import zlib
+
+pdf = sys.argv[1] if len(sys.argv) > 1 else './pdf'
+
+# a device without fonts
+DESC = 'fonts 0\nres 720\nhor 1\nvert 1\nunitwidth 10\nname utf\n'
+
+# a PDF file to include
+FIGURE = [
+	b'<< /Type /Catalog /Pages 2 0 R >>',
+	b'<< /Type /Pages /Kids [3 0 R] /Count 1 /MediaBox [0 0 100 100] >>',
+	b'<< /Type /Page /Parent 2 0 R /Contents 4 0 R /Resources << >> >>',
+	b'<< /Length 17 >>\nstream\n0 0 m 100 100 l S\nendstream',
+]
+
+def figure(path):
+	out = b'%PDF-1.4\n'
+	offs = []
+	for i, obj in enumerate(FIGURE):
+		offs.append(len(out))
+		out += b'%d 0 obj\n%s\nendobj\n' % (i + 1, obj)
+	xref = len(out)
+	out += b'xref\n0 %d\n0000000000 65535 f \n' % (len(FIGURE) + 1)
+	out += b''.join([b'%010d 00000 n \n' % off for off in offs])
+	out += b'trailer\n<< /Size %d /Root 1 0 R >>\n' % (len(FIGURE) + 1)
+	out += b'startxref\n%d\n%%%%EOF\n' % xref
+	with open(path, 'wb') as fp:
+		fp.write(out)
+
+# a few pages of drawings; the second is larger than PGSZ of pdf.c, so
+# that "-d stream=1" writes it in parts, with the figure in the middle
+def troff(fig):
+	out = 'x T utf\nx res 720 1 1\nx init\n'
+	for i in range(1, 4):
+		out += 'p%d\nV%d\nH1000\nD l 2000 %d\n' % (i, 1000 + i * 100, i * 100)
+		for j in range(12000 if i == 2 else 0):
+			out += 'V%d\nH%d\nD l 100 100\n' % (1000 + j, 1000 + j % 50)
+			if j == 6000:
+				out += 'x X pdf %s 1000\n' % fig
+	return out + 'x trailer\nx stop\n'
+
+def run(fdir, opts):
+	cmd = [pdf, '-F', fdir] + sum([['-d', o] for o in opts], [])
+	inp = troff(os.path.join(fdir, 'fig.pdf'))
+	return subprocess.run(cmd, input=inp.encode(), check=True,
+			stdout=subprocess.PIPE).stdout
+
+def xref(out, base):
+	"return the object offsets listed in the xref section of out"
+	m = re.search(rb'startxref\n(\d+)\n%%EOF\n$', out)
+	pos = int(m.group(1)) - base
+	offs = {}
+	if out.startswith(b'xref\n', pos):
+		m = re.compile(rb'xref\n0 (\d+)\n').match(out, pos)
+		tab = m.end()
+		for i in range(int(m.group(1))):
+			ent = out[tab + i * 20:tab + i * 20 + 20]
+			if ent[17:18] == b'n':
+				offs[i] = int(ent[:10])
+		return offs, 'table'
+	m = re.compile(rb'(\d+) 0 obj\n<<(.*?)>>\nstream\n', re.S).match(out, pos)
+	d = m.group(2)
+	w = [int(x) for x in re.search(rb'/W \[(\d+) (\d+) (\d+)\]', d).groups()]
+	n = int(re.search(rb'/Length (\d+)', d).group(1))
+	dat = zlib.decompress(out[m.end():m.end() + n])
+	for i in range(len(dat) // sum(w)):
+		ent = dat[i * sum(w):(i + 1) * sum(w)]
+		f = [int.from_bytes(ent[:w[0]], 'big'),
+			int.from_bytes(ent[w[0]:w[0] + w[1]], 'big')]
+		if f[0] == 1:
+			offs[i] = f[1]
+	return offs, 'stream'
+
+def check(fdir, base, opts, kind):
+	out = run(fdir, opts + ['offset=%d' % base])
+	offs, found = xref(out, base)
+	if found != kind:
+		return 'expected an xref %s, found an xref %s' % (kind, found)
+	if not offs:
+		return 'no objects in the xref section'
+	for i, off in offs.items():
+		if not out.startswith(b'%d 0 obj' % i, off - base):
+			return 'object %d is not at offset %d' % (i, off)
+	# the objects in object streams
+	for m in re.finditer(rb'/Type /ObjStm.*?/Length (\d+)\n>>\nstream\n', out, re.S):
+		out += zlib.decompress(out[m.end():m.end() + int(m.group(1))])
+	if b'/Subtype /Form' not in out:
+		return 'the included figure is missing'
+	if 'stream=1' in opts and not re.search(rb'/Contents \[ \d+ 0 R \d+ 0 R', out):
+		return 'the large page is not written in parts'
+	return None
+
+tests = [
+	(0, [], 'table'),
+	(0, ['objstm=1'], 'stream'),
+	((1 << 32) + 1, [], 'table'),
+	((1 << 32) + 1, ['objstm=1'], 'stream'),
+	((1 << 32) + 1, ['stream=1'], 'table'),
+	(9999999999 - 100, [], 'stream'),
+	(1 << 40, [], 'stream'),
+	(1 << 40, ['stream=1', 'objstm=1'], 'stream'),
+]
+failed = 0
+with tempfile.TemporaryDirectory() as fdir:
+	os.mkdir(os.path.join(fdir, 'devutf'))
+	with open(os.path.join(fdir, 'devutf', 'DESC'), 'w') as fp:
+		fp.write(DESC)
+	figure(os.path.join(fdir, 'fig.pdf'))
+	for base, opts, kind in tests:
+		err = check(fdir, base, opts, kind)
+		name = ' '.join(['offset=%d' % base] + opts)
+		print('%s: %s' % (name, err or 'ok'))
+		failed += err is not None
+sys.exit(1 if failed else 0)
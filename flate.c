@@ -0,0 +1,442 @@
+/* zlib and deflate (RFC 1950 and 1951) compression and decompression */
+#include <stdlib.h>
+#include <string.h>
+#include "post.h"
+
+#define MAXBITS		15	/* the maximum length of huffman codes */
+
+/* inflate state */
+struct inf {
+	unsigned char *src;	/* compressed data */
+	int len, pos;		/* the length of src and the current position */
+	int bitbuf, bitcnt;	/* unread bits */
+	char *out;		/* decompressed data */
+	int out_n, out_sz;
+	int out_max;		/* the maximum length of out */
+	int err;
+	int big;		/* the output exceeded out_max */
+};
+
+/* huffman decoding tables */
+struct huff {
+	short cnt[MAXBITS + 1];	/* the number of codes of each length */
+	short sym[320];		/* symbols ordered by code */
+};
+
+static int inf_bits(struct inf *s, int n)
+{
+	long val = s->bitbuf;
+	while (s->bitcnt < n) {
+		if (s->pos >= s->len) {
+			s->err = 1;
+			return 0;
+		}
+		val |= (long) s->src[s->pos++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> n;
+	s->bitcnt -= n;
+	return val & ((1L << n) - 1);
+}
+
+static void inf_put(struct inf *s, int c)
+{
+	if (s->out_n >= s->out_max) {
+		s->err = 1;
+		s->big = 1;
+		return;
+	}
+	if (s->out_n == s->out_sz) {
+		int sz = s->out_sz ? s->out_sz : 1 << 13;
+		s->out_sz = sz < s->out_max / 2 ? sz * 2 : s->out_max;
+		s->out = mextend(s->out, s->out_n, s->out_sz, 1);
+	}
+	s->out[s->out_n++] = c;
+}
+
+/* build a huffman table from code lengths; returns nonzero if over-subscribed */
+static int huff_make(struct huff *h, short *lens, int n)
+{
+	short off[MAXBITS + 1];
+	int left = 1;
+	int i;
+	memset(h->cnt, 0, sizeof(h->cnt));
+	for (i = 0; i < n; i++)
+		h->cnt[lens[i]]++;
+	for (i = 1; i <= MAXBITS; i++) {
+		left = left * 2 - h->cnt[i];
+		if (left < 0)
+			return 1;
+	}
+	off[1] = 0;
+	for (i = 1; i < MAXBITS; i++)
+		off[i + 1] = off[i] + h->cnt[i];
+	for (i = 0; i < n; i++)
+		if (lens[i])
+			h->sym[off[lens[i]]++] = i;
+	return 0;
+}
+
+static int huff_decode(struct inf *s, struct huff *h)
+{
+	int code = 0, first = 0, idx = 0;
+	int i;
+	for (i = 1; i <= MAXBITS; i++) {
+		code |= inf_bits(s, 1);
+		if (s->err)
+			return -1;
+		if (code - h->cnt[i] < first)
+			return h->sym[idx + (code - first)];
+		idx += h->cnt[i];
+		first = (first + h->cnt[i]) << 1;
+		code <<= 1;
+	}
+	s->err = 1;
+	return -1;
+}
+
+static short len_base[] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static short len_extra[] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static short dist_base[] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577};
+static short dist_extra[] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* decode the symbols of a compressed block */
+static int inf_codes(struct inf *s, struct huff *lencode, struct huff *distcode)
+{
+	int sym, len, dist;
+	while (!s->err) {
+		if ((sym = huff_decode(s, lencode)) < 0)
+			return 1;
+		if (sym < 256) {
+			inf_put(s, sym);
+			continue;
+		}
+		if (sym == 256)
+			return 0;
+		sym -= 257;
+		if (sym >= 29)
+			return 1;
+		len = len_base[sym] + inf_bits(s, len_extra[sym]);
+		if ((sym = huff_decode(s, distcode)) < 0 || sym >= 30)
+			return 1;
+		dist = dist_base[sym] + inf_bits(s, dist_extra[sym]);
+		if (dist > s->out_n)
+			return 1;
+		while (len--)
+			inf_put(s, s->out[s->out_n - dist]);
+	}
+	return 1;
+}
+
+static int inf_fixed(struct inf *s)
+{
+	static struct huff lencode, distcode;
+	static int init;
+	if (!init) {
+		short lens[288];
+		int i;
+		for (i = 0; i < 144; i++)
+			lens[i] = 8;
+		for (; i < 256; i++)
+			lens[i] = 9;
+		for (; i < 280; i++)
+			lens[i] = 7;
+		for (; i < 288; i++)
+			lens[i] = 8;
+		huff_make(&lencode, lens, 288);
+		for (i = 0; i < 30; i++)
+			lens[i] = 5;
+		huff_make(&distcode, lens, 30);
+		init = 1;
+	}
+	return inf_codes(s, &lencode, &distcode);
+}
+
+static int inf_dynamic(struct inf *s)
+{
+	static short order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	struct huff lencode, distcode;
+	short lens[320];
+	int nlen, ndist, ncode;
+	int i, sym, len;
+	nlen = inf_bits(s, 5) + 257;
+	ndist = inf_bits(s, 5) + 1;
+	ncode = inf_bits(s, 4) + 4;
+	if (s->err || nlen > 286 || ndist > 30)
+		return 1;
+	memset(lens, 0, sizeof(lens));
+	for (i = 0; i < ncode; i++)
+		lens[order[i]] = inf_bits(s, 3);
+	if (huff_make(&lencode, lens, 19))
+		return 1;
+	for (i = 0; i < nlen + ndist; ) {
+		if ((sym = huff_decode(s, &lencode)) < 0)
+			return 1;
+		if (sym < 16) {
+			lens[i++] = sym;
+			continue;
+		}
+		len = 0;
+		if (sym == 16) {
+			if (i == 0)
+				return 1;
+			len = lens[i - 1];
+			sym = 3 + inf_bits(s, 2);
+		} else if (sym == 17) {
+			sym = 3 + inf_bits(s, 3);
+		} else {
+			sym = 11 + inf_bits(s, 7);
+		}
+		if (i + sym > nlen + ndist)
+			return 1;
+		while (sym--)
+			lens[i++] = len;
+	}
+	if (lens[256] == 0)
+		return 1;
+	if (huff_make(&lencode, lens, nlen) || huff_make(&distcode, lens + nlen, ndist))
+		return 1;
+	return inf_codes(s, &lencode, &distcode);
+}
+
+/* decompress zlib data into dst; returns nonzero on errors */
+/* decompress zlib data; fails if the output is longer than max */
+int flate_inflate(char *src, int len, struct sbuf *dst, int max)
+{
+	struct inf s;
+	int last, type, n;
+	int ret = 0;
+	memset(&s, 0, sizeof(s));
+	s.src = (void *) src;
+	s.len = len;
+	s.out_max = max;
+	/* the zlib header */
+	if (len < 2 || (s.src[0] & 0x0f) != 8 || ((s.src[0] << 8) | s.src[1]) % 31)
+		return 1;
+	s.pos = 2;
+	do {
+		last = inf_bits(&s, 1);
+		type = inf_bits(&s, 2);
+		if (s.err)
+			break;
+		if (type == 0) {		/* stored blocks */
+			s.bitbuf = 0;
+			s.bitcnt = 0;
+			if (s.pos + 4 > s.len)
+				break;
+			n = s.src[s.pos] | (s.src[s.pos + 1] << 8);
+			s.pos += 4;
+			if (s.pos + n > s.len)
+				break;
+			while (n--)
+				inf_put(&s, s.src[s.pos++]);
+		} else if (type == 1) {
+			ret = inf_fixed(&s);
+		} else if (type == 2) {
+			ret = inf_dynamic(&s);
+		} else {
+			ret = 1;
+		}
+	} while (!last && !ret && !s.err);
+	/* truncated streams are accepted, as most PDF readers do */
+	if (s.out_n && !s.big)
+		sbuf_mem(dst, s.out, s.out_n);
+	free(s.out);
+	return s.big || (ret && !s.out_n);
+}
+
+/* deflate state */
+struct def {
+	struct sbuf *dst;	/* compressed data */
+	unsigned long bitbuf;	/* bits not yet written */
+	int bitcnt;
+};
+
+#define WSIZE		(1 << 15)	/* deflate window size */
+#define HBITS		15		/* the number of bits in match hashes */
+#define HASH(s)		((((s)[0] << 10) ^ ((s)[1] << 5) ^ (s)[2]) & ((1 << HBITS) - 1))
+#define MAXCHAIN	64		/* the number of match candidates to try */
+
+static void def_bits(struct def *s, int val, int n)
+{
+	s->bitbuf |= (unsigned long) val << s->bitcnt;
+	s->bitcnt += n;
+	while (s->bitcnt >= 8) {
+		sbuf_chr(s->dst, s->bitbuf & 0xff);
+		s->bitbuf >>= 8;
+		s->bitcnt -= 8;
+	}
+}
+
+/* huffman codes are packed starting from their most significant bit */
+static void def_code(struct def *s, int code, int n)
+{
+	int rev = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		rev = (rev << 1) | ((code >> i) & 1);
+	def_bits(s, rev, n);
+}
+
+/* write a literal/length symbol with fixed huffman codes */
+static void def_sym(struct def *s, int sym)
+{
+	if (sym < 144)
+		def_code(s, 0x30 + sym, 8);
+	else if (sym < 256)
+		def_code(s, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		def_code(s, sym - 256, 7);
+	else
+		def_code(s, 0xc0 + sym - 280, 8);
+}
+
+static void def_match(struct def *s, int len, int dist)
+{
+	int i = LEN(len_base) - 1;
+	int j = LEN(dist_base) - 1;
+	while (len_base[i] > len)
+		i--;
+	while (dist_base[j] > dist)
+		j--;
+	def_sym(s, 257 + i);
+	def_bits(s, len - len_base[i], len_extra[i]);
+	def_code(s, j, 5);
+	def_bits(s, dist - dist_base[j], dist_extra[j]);
+}
+
+/* the longest match of s[pos] in the window; returns its length */
+static int def_find(unsigned char *s, int len, int pos, int *head, int *prev, int *dist)
+{
+	int max = MIN(258, len - pos);
+	int best = 0;
+	int chain = MAXCHAIN;
+	int p = head[HASH(s + pos)];
+	while (p >= 0 && pos - p <= WSIZE && chain--) {
+		if (s[p + best] == s[pos + best]) {
+			int n = 0;
+			while (n < max && s[p + n] == s[pos + n])
+				n++;
+			if (n > best) {
+				best = n;
+				*dist = pos - p;
+				if (n == max)
+					break;
+			}
+		}
+		if (prev[p & (WSIZE - 1)] >= p)
+			break;
+		p = prev[p & (WSIZE - 1)];
+	}
+	return best;
+}
+
+/* compress src as zlib data, using a single block with fixed huffman codes */
+void flate_deflate(char *src, int len, struct sbuf *dst)
+{
+	unsigned char *s = (void *) src;
+	int *head = malloc((1 << HBITS) * sizeof(head[0]));
+	int *prev = malloc(WSIZE * sizeof(prev[0]));
+	unsigned long a = 1, b = 0;
+	struct def d;
+	int i, j, n, dist;
+	memset(&d, 0, sizeof(d));
+	d.dst = dst;
+	for (i = 0; i < (1 << HBITS); i++)
+		head[i] = -1;
+	sbuf_chr(dst, 0x78);
+	sbuf_chr(dst, 0x9c);
+	def_bits(&d, 1, 1);	/* the last block */
+	def_bits(&d, 1, 2);	/* fixed huffman codes */
+	for (i = 0; i < len; ) {
+		n = i + 2 < len ? def_find(s, len, i, head, prev, &dist) : 0;
+		if (n >= 3) {
+			def_match(&d, n, dist);
+		} else {
+			def_sym(&d, s[i]);
+			n = 1;
+		}
+		for (j = 0; j < n; j++, i++) {
+			if (i + 2 < len) {
+				prev[i & (WSIZE - 1)] = head[HASH(s + i)];
+				head[HASH(s + i)] = i;
+			}
+		}
+	}
+	def_sym(&d, 256);
+	def_bits(&d, 0, 7);	/* padding the last byte */
+	/* the adler-32 checksum */
+	for (i = 0; i < len; i += 5552) {
+		for (j = i; j < len && j < i + 5552; j++) {
+			a += s[j];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	sbuf_chr(dst, b >> 8);
+	sbuf_chr(dst, b);
+	sbuf_chr(dst, a >> 8);
+	sbuf_chr(dst, a);
+	free(head);
+	free(prev);
+}
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+/*
+ * reverse PNG predictors (RFC 2083) applied to rows of rowlen bytes
+ *
+ * Each row starts with a filter type byte; bpp is the number of bytes
+ * per pixel.  Returns nonzero on errors.
+ */
+int flate_unpredict(struct sbuf *sb, int rowlen, int bpp)
+{
+	int n = sbuf_len(sb) / (rowlen + 1);
+	unsigned char *s = (void *) sbuf_buf(sb);
+	unsigned char *d = s;
+	unsigned char *prev = NULL;
+	int i, j;
+	if (rowlen <= 0)
+		return 1;
+	for (i = 0; i < n; i++) {
+		int type = s[i * (rowlen + 1)];
+		unsigned char *src = s + i * (rowlen + 1) + 1;
+		unsigned char *row = d + i * rowlen;
+		for (j = 0; j < rowlen; j++) {
+			int a = j >= bpp ? row[j - bpp] : 0;
+			int b = prev ? prev[j] : 0;
+			int c = prev && j >= bpp ? prev[j - bpp] : 0;
+			int x = src[j];
+			if (type == 1)
+				x += a;
+			if (type == 2)
+				x += b;
+			if (type == 3)
+				x += (a + b) / 2;
+			if (type == 4)
+				x += paeth(a, b, c);
+			row[j] = x;
+		}
+		prev = row;
+	}
+	sbuf_cut(sb, n * rowlen);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* tracking graphics state to avoid redundant operators */
+#include <string.h>
+#include "post.h"
+
+#define NSAVE		32	/* the depth of saved states */
+
+static int gs_cur[GS_N];		/* current values; -1 if unknown */
+static int gs_saved[NSAVE][GS_N];	/* saved states */
+static int gs_n;			/* save nesting depth */
+
+/* forget all state, as at the beginning of a page */
+void gs_reset(void)
+{
+	memset(gs_cur, 0xff, sizeof(gs_cur));
+	gs_n = 0;
+}
+
+int gs_get(int key)
+{
+	return gs_cur[key];
+}
+
+/* record a new value; returns nonzero if it should be written */
+int gs_set(int key, int val)
+{
+	if (val >= 0 && gs_cur[key] == val)
+		return 0;
+	gs_cur[key] = val;
+	return 1;
+}
+
+void gs_save(void)
+{
+	if (gs_n < NSAVE)
+		memcpy(gs_saved[gs_n], gs_cur, sizeof(gs_cur));
+	gs_n++;
+}
+
+void gs_restore(void)
+{
+	if (gs_n > 0 && --gs_n < NSAVE)
+		memcpy(gs_cur, gs_saved[gs_n], sizeof(gs_cur));
+	else
+		memset(gs_cur, 0xff, sizeof(gs_cur));
+}
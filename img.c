@@ -0,0 +1,261 @@
+/* reading JPEG and PNG images */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "post.h"
+
+#define U16(s)		(((s)[0] << 8) | (s)[1])
+#define U32(s)		(((unsigned) U16(s) << 16) | U16((s) + 2))
+
+static struct img *img_make(void)
+{
+	struct img *img = malloc(sizeof(*img));
+	memset(img, 0, sizeof(*img));
+	img->dat = sbuf_make();
+	return img;
+}
+
+void img_free(struct img *img)
+{
+	sbuf_free(img->dat);
+	if (img->alpha)
+		sbuf_free(img->alpha);
+	if (img->pal)
+		sbuf_free(img->pal);
+	free(img);
+}
+
+/* JPEG files are included as they are */
+static struct img *img_jpeg(unsigned char *s, int len)
+{
+	struct img *img;
+	int adobe = 0;
+	int pos = 2;
+	while (pos + 4 <= len) {
+		int m, n;
+		if (s[pos] != 0xff)
+			return NULL;
+		m = s[pos + 1];
+		if (m == 0xff) {	/* fill bytes */
+			pos++;
+			continue;
+		}
+		n = U16(s + pos + 2);
+		if (m == 0xda || m == 0xd9 || pos + 2 + n > len)
+			return NULL;
+		if (m == 0xee && n >= 7 && !memcmp("Adobe", s + pos + 4, 5))
+			adobe = 1;
+		/* start of frame markers, other than DHT, JPG, and DAC */
+		if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+			int bpc, w, h, ncomp;
+			if (n < 8)
+				return NULL;
+			bpc = s[pos + 4];
+			h = U16(s + pos + 5);
+			w = U16(s + pos + 7);
+			ncomp = s[pos + 9];
+			if (w <= 0 || h <= 0 || bpc != 8 || (ncomp != 1 && ncomp != 3 && ncomp != 4))
+				return NULL;
+			img = img_make();
+			img->fmt = 'j';
+			img->bpc = bpc;
+			img->h = h;
+			img->w = w;
+			img->ncomp = ncomp;
+			/* Adobe CMYK files are usually inverted */
+			img->inv = adobe && img->ncomp == 4;
+			sbuf_mem(img->dat, (void *) s, len);
+			return img;
+		}
+		pos += 2 + n;
+	}
+	return NULL;
+}
+
+/* the i-th sample of a row with bpc bits per sample */
+static int img_sample(unsigned char *row, int bpc, int i)
+{
+	if (bpc == 16)
+		return U16(row + i * 2);
+	if (bpc == 8)
+		return row[i];
+	return (row[i * bpc / 8] >> (8 - bpc - i * bpc % 8)) & ((1 << bpc) - 1);
+}
+
+/* decode PNG image data with comp samples per pixel */
+static struct sbuf *img_rows(struct sbuf *idat, int w, int h, int comp, int bpc)
+{
+	struct sbuf *rows = sbuf_make();
+	int rowlen = (w * comp * bpc + 7) / 8;
+	if ((long long) h * rowlen > (1 << 30) ||
+			flate_inflate(sbuf_buf(idat), sbuf_len(idat), rows, h * (rowlen + 1)) ||
+			flate_unpredict(rows, rowlen, (comp * bpc + 7) / 8) ||
+			sbuf_len(rows) < h * rowlen) {
+		sbuf_free(rows);
+		return NULL;
+	}
+	sbuf_cut(rows, h * rowlen);
+	return rows;
+}
+
+/* separate alpha samples of decoded PNG rows; only their high bytes are kept */
+static void img_alpha(struct img *img, struct sbuf *rows, struct sbuf *dat)
+{
+	char *s = sbuf_buf(rows);
+	int sz = img->bpc / 8;
+	int i;
+	for (i = 0; i < sbuf_len(rows); i += (img->ncomp + 1) * sz) {
+		sbuf_mem(dat, s + i, img->ncomp * sz);
+		sbuf_chr(img->alpha, s[i + img->ncomp * sz]);
+	}
+}
+
+/* alpha samples specified by PNG tRNS chunks */
+static void img_trns(struct img *img, struct sbuf *rows, int ctype, unsigned char *trns, int n)
+{
+	unsigned char *s = (void *) sbuf_buf(rows);
+	int rowlen = (img->w * img->ncomp * img->bpc + 7) / 8;
+	int x, y, i;
+	for (y = 0; y < img->h; y++) {
+		unsigned char *row = s + y * rowlen;
+		for (x = 0; x < img->w; x++) {
+			int a = 0;
+			if (ctype == 3) {
+				int idx = img_sample(row, img->bpc, x);
+				a = idx < n ? trns[idx] : 255;
+			}
+			/* opaque, unless the pixel matches the transparent colour */
+			for (i = 0; ctype != 3 && i < img->ncomp; i++)
+				if (n < i * 2 + 2 || img_sample(row, img->bpc, x * img->ncomp + i) !=
+						(U16(trns + i * 2) & ((1 << img->bpc) - 1)))
+					a = 255;
+			sbuf_chr(img->alpha, a);
+		}
+	}
+}
+
+/* compress sb with zlib */
+static struct sbuf *img_deflate(struct sbuf *sb)
+{
+	struct sbuf *dst = sbuf_make();
+	flate_deflate(sbuf_buf(sb), sbuf_len(sb), dst);
+	sbuf_free(sb);
+	return dst;
+}
+
+/*
+ * PNG files without transparency are included without decoding their
+ * compressed data, which is the same as PDF's FlateDecode data with
+ * PNG predictors.  The alpha channel of other files is separated and
+ * compressed again.
+ */
+static struct img *img_png(unsigned char *s, int len)
+{
+	struct img *img;
+	struct sbuf *idat = sbuf_make();
+	struct sbuf *pal = NULL;
+	struct sbuf *rows;
+	unsigned char *trns = NULL;
+	int w = 0, h = 0, bpc = 0, ctype = -1, lace = 0;
+	int trns_n = 0;
+	int pos = 8;
+	while (pos + 12 <= len) {
+		int n = U32(s + pos);
+		unsigned char *d = s + pos + 8;
+		if (n < 0 || pos + 12 + n > len)
+			break;
+		if (!memcmp("IHDR", s + pos + 4, 4) && n >= 13) {
+			w = U32(d);
+			h = U32(d + 4);
+			bpc = d[8];
+			ctype = d[9];
+			lace = d[12];
+		}
+		/* PNG allows a single PLTE chunk; ignore repeats */
+		if (!memcmp("PLTE", s + pos + 4, 4) && !pal) {
+			pal = sbuf_make();
+			sbuf_mem(pal, (void *) d, n - n % 3);
+		}
+		if (!memcmp("tRNS", s + pos + 4, 4) && !trns) {
+			trns = d;
+			trns_n = n;
+		}
+		if (!memcmp("IDAT", s + pos + 4, 4))
+			sbuf_mem(idat, (void *) d, n);
+		if (!memcmp("IEND", s + pos + 4, 4))
+			break;
+		pos += 12 + n;
+	}
+	if (w <= 0 || h <= 0 || w > (1 << 20) || h > (1 << 20) || lace || (ctype == 3 && !pal) ||
+			(ctype != 0 && ctype != 2 && ctype != 3 && ctype != 4 && ctype != 6) ||
+			(bpc != 8 && bpc != 16 && (ctype == 2 || ctype == 4 || ctype == 6)) ||
+			(bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16) ||
+			(ctype == 3 && bpc == 16)) {
+		if (lace)
+			fprintf(stderr, "neatpost: interlaced PNG files are not supported\n");
+		if (pal)
+			sbuf_free(pal);
+		sbuf_free(idat);
+		return NULL;
+	}
+	img = img_make();
+	img->w = w;
+	img->h = h;
+	img->bpc = bpc;
+	img->ncomp = ctype == 2 || ctype == 6 ? 3 : 1;
+	img->pal = ctype == 3 ? pal : NULL;
+	if (ctype != 3 && pal)
+		sbuf_free(pal);
+	if (ctype == 4 || ctype == 6) {
+		if (!(rows = img_rows(idat, w, h, img->ncomp + 1, bpc))) {
+			sbuf_free(idat);
+			img_free(img);
+			return NULL;
+		}
+		img->alpha = sbuf_make();
+		img_alpha(img, rows, img->dat);
+		img->fmt = 'f';
+		img->dat = img_deflate(img->dat);
+		img->alpha = img_deflate(img->alpha);
+		sbuf_free(rows);
+		sbuf_free(idat);
+		return img;
+	}
+	if (trns && (rows = img_rows(idat, w, h, img->ncomp, bpc))) {
+		img->alpha = sbuf_make();
+		img_trns(img, rows, ctype, trns, trns_n);
+		img->alpha = img_deflate(img->alpha);
+		sbuf_free(rows);
+	}
+	img->fmt = 'p';
+	sbuf_free(img->dat);
+	img->dat = idat;
+	return img;
+}
+
+/* read a JPEG or PNG file */
+struct img *img_open(char *path)
+{
+	struct sbuf *sb;
+	struct img *img = NULL;
+	unsigned char *s;
+	char buf[1 << 12];
+	int fd, nr;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	sb = sbuf_make();
+	while ((nr = read(fd, buf, sizeof(buf))) > 0)
+		sbuf_mem(sb, buf, nr);
+	close(fd);
+	s = (void *) sbuf_buf(sb);
+	if (sbuf_len(sb) > 3 && s[0] == 0xff && s[1] == 0xd8)
+		img = img_jpeg(s, sbuf_len(sb));
+	if (sbuf_len(sb) > 8 && !memcmp("\x89PNG\r\n\x1a\n", s, 8))
+		img = img_png(s, sbuf_len(sb));
+	sbuf_free(sb);
+	if (!img)
+		fprintf(stderr, "neatpost: cannot read image %s\n", path);
+	return img;
+}
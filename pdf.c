@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "post.h"
 
 static char pdf_title[256];	/* document title */
@@ -15,57 +16,150 @@ static int pdf_height;		/* page height */
 static int pdf_linewid;		/* line width in thousands of ems */
 static int pdf_linecap = 1;	/* line cap style: 0 (butt), 1 (round), 2 (projecting square) */
 static int pdf_linejoin = 1;	/* line join style: 0 (miter), 1 (round), 2 (bevel) */
+static int pdf_cff;		/* convert Type 1 fonts to CFF */
 static int pdf_pages;		/* pages object id */
 static int pdf_root;		/* root object id */
-static int pdf_pos;		/* current pdf file offset */
-static int *obj_off;		/* object offsets */
+static long long pdf_pos;	/* current pdf file offset */
+static long long pdf_base;	/* assumed file offset of the output; only for check.py */
+static long long *obj_off;	/* object offsets */
 static int obj_sz, obj_n;	/* number of pdf objects */
+static int *obj_stm;		/* the object stream containing each object, if any */
+static int pdf_stream;		/* write page contents as they are produced */
+static int pdf_objstm;		/* use object streams and a cross-reference stream */
+static struct sbuf *pdf_sink;	/* if set, pdf output is appended to it */
 static int *page_id;		/* page object ids */
 static int page_sz, page_n;	/* number of pages */
 static int pdf_outline;		/* pdf outline hierarchiy */
 static int pdf_dests;		/* named destinations */
+static struct dict *pdf_fontfile;	/* embedded font programs by content digest */
+static struct dict *pdf_fontdesc;	/* font descriptors by digest and name */
+static struct dict *pdf_objs;	/* shared objects by content digest */
+static struct dict *pdf_drawmap;	/* the digests of drawings written inline */
+static struct dict *pdf_fragmap;	/* forms of repeated page fragments by digest */
+static struct dict *pdf_xobjs;	/* XObjects of included PDF files */
+static struct dict *pdf_docmap;	/* indices of included PDF files in pdocs[] */
+static struct pdoc *pdocs;	/* included PDF files */
+static int pdocs_n, pdocs_sz;
+static struct dict *pdf_imgmap;	/* indices of included images in pimgs[] */
+static struct pimg *pimgs;	/* included images */
+static int pimgs_n, pimgs_sz;
 
 static struct sbuf *pg;		/* current page contents */
+static int *pg_ids;		/* streamed page contents objects */
+static int pg_n, pg_sz;
 static int o_f, o_s, o_m;	/* font and size */
 static int o_h, o_v;		/* current user position */
+static long long p_x;		/* the exact horizontal pen position; see PEN() */
 static int p_h, p_v;		/* current output position */
-static int o_i, p_i;		/* output and pdf fonts (indices into pfont[]) */
-static int p_f, p_s, p_m;	/* output font */
+static long long t_w;		/* word spacing; see PEN() */
+static int t_gap;		/* the word space for which t_w was chosen */
+static int t_h, t_v;		/* the start of the current text line */
+static int t_l;			/* text leading */
+static int f_beg, f_op, f_opend;	/* page fragment start and its text positioning */
+static int f_h, f_v;		/* the position of the text of the fragment */
+static int f_bad;		/* the fragment cannot be shared */
+static int f_fonts[16], f_fonts_n;	/* fonts selected in the fragment */
+static char o_str[256];		/* queued glyph codes */
+static int o_str_n;
+static int pdf_vh;		/* page height in basic units */
+static int o_i;			/* output font (index into pfont[]) */
 static int o_queued;		/* queued character type */
-static char o_iset[1024];	/* fonts accessed in this page */
-static int xobj[128];		/* page xobject object ids */
-static int xobj_n;		/* number of xobjects in this page */
-static int ann[128];		/* page annotations */
-static int ann_n;		/* number of annotations in this page */
+static int *o_fonts;		/* fonts accessed in this page (indices into pfont[]) */
+static int o_fonts_n, o_fonts_sz;
+static int *xobj;		/* page xobject object ids */
+static int xobj_n, xobj_sz;	/* number of xobjects in this page */
+static int *xobj_idx;		/* the index of objects in xobj[] plus one */
+static int xobj_idx_sz;
+static int *ann;		/* page annotations */
+static int ann_n, ann_sz;	/* number of annotations in this page */
+
+/* included PDF files */
+struct pdoc {
+	struct pdf *pdf;	/* the parsed file */
+	int *ids;		/* object IDs of copied objects; -1 while copying */
+	int ids_n;		/* size of ids[] */
+	int *todo;		/* objects to copy later: number and position pairs */
+	int todo_n, todo_sz;
+};
+
+/* included images */
+struct pimg {
+	int obj;		/* XObject identifier; -1 if not readable */
+	int w, h;		/* image dimensions in pixels */
+};
 
 /* loaded PDF fonts */
 struct pfont {
 	char name[128];		/* font PostScript name */
 	char path[1024];	/* font path */
 	char desc[1024];	/* font descriptor path */
-	int gbeg;		/* the first glyph */
-	int gend;		/* the last glyph */
 	int sub;		/* subfont number */
+	int base;		/* the first subfont of this font */
+	struct dict *gmap;	/* glyph codes (sub * 256 + code) in base */
+	char *gl[256];		/* glyph names of the codes of this subfont */
+	int gc[256];		/* glyph CIDs of the codes of this subfont */
+	int gw[256];		/* glyph widths of the codes of this subfont */
+	int gn;			/* number of allocated codes; see PCODE() */
 	int obj;		/* the font object */
 	int des;		/* font descriptor */
 	int cid;		/* CID-indexed */
+	int cidfont;		/* the CIDFont object in base */
+	int page;		/* the last page using this font plus one */
 };
 
 static struct pfont *pfonts;
 static int pfonts_n, pfonts_sz;
 
+/* the code of the n-th glyph of a subfont; code 32 is reserved for word spaces */
+#define PCODE(n)	(((n) + 33) & 0xff)
+/* the pen is tracked in 1/72000 of basic units, to follow widths exactly */
+#define PEN(h)		((long long) (h) * 72000)
+/* the error allowed in the position of glyphs: a tenth of a point */
+#define PENTOL		((long long) dev_res * 100)
+
+/* the size of the page contents buffer in streaming mode */
+#define PGSZ		(1 << 16)
+/* the number of objects in each object stream */
+#define OSTMN		100
+
+/* append formatted output to pdf_sink */
+static void pdfdefer(char *s, va_list ap)
+{
+	char buf[256];
+	va_list ap2;
+	int n;
+	va_copy(ap2, ap);
+	n = vsnprintf(buf, sizeof(buf), s, ap2);
+	va_end(ap2);
+	if (n < sizeof(buf)) {
+		sbuf_mem(pdf_sink, buf, n);
+	} else {
+		char *b = malloc(n + 1);
+		vsnprintf(b, n + 1, s, ap);
+		sbuf_mem(pdf_sink, b, n);
+		free(b);
+	}
+}
+
 /* print formatted pdf output */
 static void pdfout(char *s, ...)
 {
 	va_list ap;
 	va_start(ap, s);
-	pdf_pos += vprintf(s, ap);
+	if (pdf_sink)
+		pdfdefer(s, ap);
+	else
+		pdf_pos += vprintf(s, ap);
 	va_end(ap);
 }
 
 /* print pdf output */
 static void pdfmem(char *s, int len)
 {
+	if (pdf_sink) {
+		sbuf_mem(pdf_sink, s, len);
+		return;
+	}
 	fwrite(s, len, 1, stdout);
 	pdf_pos += len;
 }
@@ -76,26 +170,192 @@ static int obj_map(void)
 	if (obj_n == obj_sz) {
 		obj_sz += 1024;
 		obj_off = mextend(obj_off, obj_n, obj_sz, sizeof(obj_off[0]));
+		obj_stm = mextend(obj_stm, obj_n, obj_sz, sizeof(obj_stm[0]));
 	}
 	return obj_n++;
 }
 
-/* start the definition of an object */
-static int obj_beg(int id)
+/* write the header of an object */
+static int obj_head(int id)
 {
-	if (id <= 0)
-		id = obj_map();
 	obj_off[id] = pdf_pos;
 	pdfout("%d 0 obj\n", id);
 	return id;
 }
 
+/*
+ * Object streams
+ *
+ * With pdf_objstm, objects other than streams are collected in
+ * compressed object streams of OSTMN objects, and the xref table is
+ * replaced with a cross-reference stream.  obj_off[] holds the index
+ * of such objects in their object stream, obj_stm[].
+ */
+static struct sbuf *obj_body;	/* the contents of the current object */
+static int obj_cur;		/* the current object, while collected in obj_body */
+static int obj_curstm;		/* the current object is a stream */
+static struct sbuf *ostm_hdr;	/* object numbers and offsets of the current object stream */
+static struct sbuf *ostm_dat;	/* objects of the current object stream */
+static int ostm_id, ostm_n;	/* the current object stream and its number of objects */
+
+/* write the current object stream */
+static void ostm_flush(void)
+{
+	struct sbuf *sb;
+	int first;
+	if (!ostm_n)
+		return;
+	sbuf_chr(ostm_hdr, '\n');
+	first = sbuf_len(ostm_hdr);
+	sbuf_mem(ostm_hdr, sbuf_buf(ostm_dat), sbuf_len(ostm_dat));
+	sb = sbuf_make();
+	flate_deflate(sbuf_buf(ostm_hdr), sbuf_len(ostm_hdr), sb);
+	obj_head(ostm_id);
+	pdfout("<<\n");
+	pdfout("  /Type /ObjStm\n");
+	pdfout("  /N %d\n", ostm_n);
+	pdfout("  /First %d\n", first);
+	pdfout("  /Filter /FlateDecode\n");
+	pdfout("  /Length %d\n", sbuf_len(sb));
+	pdfout(">>\n");
+	pdfout("stream\n");
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
+	pdfout("\nendstream\n");
+	pdfout("endobj\n\n");
+	sbuf_free(sb);
+	sbuf_cut(ostm_hdr, 0);
+	sbuf_cut(ostm_dat, 0);
+	ostm_n = 0;
+}
+
+/* add an object to the current object stream */
+static void ostm_put(int id, struct sbuf *sb)
+{
+	if (!ostm_n)
+		ostm_id = obj_map();
+	obj_stm[id] = ostm_id;
+	obj_off[id] = ostm_n++;
+	sbuf_int(ostm_hdr, id);
+	sbuf_chr(ostm_hdr, ' ');
+	sbuf_int(ostm_hdr, sbuf_len(ostm_dat));
+	sbuf_chr(ostm_hdr, ' ');
+	sbuf_mem(ostm_dat, sbuf_buf(sb), sbuf_len(sb));
+	if (ostm_n == OSTMN)
+		ostm_flush();
+}
+
+/* start the definition of an object; streams cannot be in object streams */
+static int obj_beg(int id, int stream)
+{
+	if (id <= 0)
+		id = obj_map();
+	if (!pdf_objstm)
+		return obj_head(id);
+	/* the object is collected to decide where to write it */
+	obj_cur = id;
+	obj_curstm = stream;
+	sbuf_cut(obj_body, 0);
+	pdf_sink = obj_body;
+	return id;
+}
+
 /* end an object definition */
 static void obj_end(void)
 {
+	if (obj_cur) {
+		int id = obj_cur;
+		obj_cur = 0;
+		pdf_sink = NULL;
+		if (!obj_curstm) {
+			ostm_put(id, obj_body);
+			return;
+		}
+		obj_head(id);
+		pdfmem(sbuf_buf(obj_body), sbuf_len(obj_body));
+	}
 	pdfout("endobj\n\n");
 }
 
+/*
+ * In streaming mode, page contents are written once they grow beyond
+ * PGSZ, each part as a separate compressed stream; docpageend() lists
+ * them in the /Contents array of the page.  Since no stream is left
+ * open, other objects can be written at any time.
+ */
+static void pg_flush(void)
+{
+	struct sbuf *sb;
+	if (pg_n == pg_sz) {
+		pg_sz += 64;
+		pg_ids = mextend(pg_ids, pg_n, pg_sz, sizeof(pg_ids[0]));
+	}
+	sb = sbuf_make();
+	flate_deflate(sbuf_buf(pg), sbuf_len(pg), sb);
+	pg_ids[pg_n++] = obj_beg(0, 1);
+	pdfout("<<\n");
+	pdfout("  /Filter /FlateDecode\n");
+	pdfout("  /Length %d\n", sbuf_len(sb));
+	pdfout(">>\n");
+	pdfout("stream\n");
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
+	pdfout("\nendstream\n");
+	obj_end();
+	sbuf_free(sb);
+	sbuf_cut(pg, 0);
+	/* the current fragment can no longer be replaced */
+	f_beg = 0;
+	f_bad = 1;
+}
+
+static void pg_stream(void)
+{
+	if (pdf_stream && sbuf_len(pg) >= PGSZ)
+		pg_flush();
+}
+
+/*
+ * the digest of s: its length and two 64-bit hashes
+ *
+ * Objects with equal digests are considered identical.  The second
+ * hash mixes 8-byte words with multiplications and shifts and has
+ * nothing in common with FNV-1a, so that a false match needs both
+ * hashes to collide; comparing the contents instead would require
+ * keeping every shared object in memory.
+ */
+static void pdf_digest(char *d, char *s, int len)
+{
+	unsigned long long h = 0xcbf29ce484222325ull;
+	unsigned long long g = len;
+	unsigned long long w = 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 0x100000001b3ull;
+		w = (w << 8) | (unsigned char) s[i];
+		if (i % 8 == 7 || i + 1 == len) {
+			g = (g ^ w) * 0x9e3779b97f4a7c15ull;
+			g ^= g >> 31;
+			w = 0;
+		}
+	}
+	sprintf(d, "%016llx%016llx.%d", h, g, len);
+}
+
+/* write an object with the given contents, unless an identical one exists */
+static int obj_shared(struct sbuf *sb, int stream)
+{
+	char key[64];
+	int id;
+	pdf_digest(key, sbuf_buf(sb), sbuf_len(sb));
+	if ((id = dict_get(pdf_objs, key)) >= 0)
+		return id;
+	id = obj_beg(0, stream);
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
+	obj_end();
+	dict_put(pdf_objs, key, id);
+	return id;
+}
+
 void out(char *s, ...)
 {
 }
@@ -121,7 +381,7 @@ static int type1lengths(char *t1, int l, int *l1, int *l2, int *l3)
 	return 0;
 }
 
-/* return font type: 't': TrueType, '1': Type 1, 'o': OpenType */
+/* return font type: 't': TrueType or OpenType, '1': Type 1 */
 static int fonttype(char *path)
 {
 	char *ext = strrchr(path, '.');
@@ -137,39 +397,55 @@ static int fonttype(char *path)
 /* write the object corresponding to the given font */
 static void pfont_write(struct pfont *ps)
 {
+	struct sbuf *sb = sbuf_make();
+	int beg, end;
 	int i;
 	int enc_obj;
-	struct font *fn = dev_fontopen(ps->desc);
 	/* the encoding object */
-	enc_obj = obj_beg(0);
-	pdfout("<<\n");
-	pdfout("  /Type /Encoding\n");
-	pdfout("  /Differences [ %d", ps->gbeg % 256);
-	for (i = ps->gbeg; i <= ps->gend; i++)
-		pdfout(" /%s", font_glget(fn, i)->id);
-	pdfout(" ]\n");
-	pdfout(">>\n");
-	obj_end();
+	sbuf_str(sb, "<<\n");
+	sbuf_str(sb, "  /Type /Encoding\n");
+	sbuf_str(sb, "  /Differences [");
+	for (i = 0; i < 256; i++) {
+		if (!ps->gl[i])
+			continue;
+		if (!i || !ps->gl[i - 1]) {
+			sbuf_chr(sb, ' ');
+			sbuf_int(sb, i);
+		}
+		sbuf_str(sb, " /");
+		sbuf_str(sb, ps->gl[i]);
+	}
+	sbuf_str(sb, " ]\n");
+	sbuf_str(sb, ">>\n");
+	enc_obj = obj_shared(sb, 0);
 	/* the font object */
-	obj_beg(ps->obj);
-	pdfout("<<\n");
-	pdfout("  /Type /Font\n");
+	sbuf_cut(sb, 0);
+	sbuf_str(sb, "<<\n");
+	sbuf_str(sb, "  /Type /Font\n");
 	if (fonttype(ps->path) == 't')
-		pdfout("  /Subtype /TrueType\n");
+		sbuf_str(sb, "  /Subtype /TrueType\n");
 	else
-		pdfout("  /Subtype /Type1\n");
-	pdfout("  /BaseFont /%s\n", ps->name);
-	pdfout("  /FirstChar %d\n", ps->gbeg % 256);
-	pdfout("  /LastChar %d\n", ps->gend % 256);
-	pdfout("  /Widths [");
-	for (i = ps->gbeg; i <= ps->gend; i++)
-		pdfout(" %d", (long long) font_glget(fn, i)->wid * 100 * 72 / dev_res);
-	pdfout(" ]\n");
-	pdfout("  /FontDescriptor %d 0 R\n", ps->des);
-	pdfout("  /Encoding %d 0 R\n", enc_obj);
-	pdfout(">>\n");
+		sbuf_str(sb, "  /Subtype /Type1\n");
+	sbuf_printf(sb, "  /BaseFont /%s\n", ps->name);
+	for (beg = 0; beg < 255 && !ps->gl[beg]; beg++)
+		;
+	for (end = 255; end > beg && !ps->gl[end]; end--)
+		;
+	sbuf_printf(sb, "  /FirstChar %d\n", beg);
+	sbuf_printf(sb, "  /LastChar %d\n", end);
+	sbuf_str(sb, "  /Widths [");
+	for (i = beg; i <= end; i++) {
+		sbuf_chr(sb, ' ');
+		sbuf_int(sb, ps->gw[i]);
+	}
+	sbuf_str(sb, " ]\n");
+	sbuf_printf(sb, "  /FontDescriptor %d 0 R\n", ps->des);
+	sbuf_printf(sb, "  /Encoding %d 0 R\n", enc_obj);
+	sbuf_str(sb, ">>\n");
+	obj_beg(ps->obj, 0);
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
 	obj_end();
-	font_close(fn);
+	sbuf_free(sb);
 }
 
 static void encodehex(struct sbuf *d, char *s, int n)
@@ -185,41 +461,175 @@ static void encodehex(struct sbuf *d, char *s, int n)
 	sbuf_str(d, ">\n");
 }
 
-/* write the object corresponding to this CID font */
-static void pfont_writecid(struct pfont *ps)
+static int cidcmp(void *v1, void *v2)
 {
-	int cid_obj;
-	struct font *fn = dev_fontopen(ps->desc);
-	int gcnt = 0;
-	int i;
-	/* CIDFont */
-	cid_obj = obj_beg(0);
+	return ((int *) v1)[0] - ((int *) v2)[0];
+}
+
+/* the end of the run of consecutive CIDs with equal widths starting at i */
+static int cw_run(int *cw, int n, int i)
+{
+	int j;
+	for (j = i + 1; j < n; j++)
+		if (cw[j * 2] != cw[j * 2 - 2] + 1 || cw[j * 2 + 1] != cw[i * 2 + 1])
+			break;
+	return j;
+}
+
+/* write the CIDFont shared by the subfonts of base */
+static void pfont_writecidfont(int base)
+{
+	struct pfont *ps = &pfonts[base];
+	struct sbuf *sb;
+	int *cw = NULL;		/* CID and width pairs */
+	int n = 0, sz = 0;
+	int i, j;
+	for (i = base; i < pfonts_n; i++) {
+		if (pfonts[i].base != base)
+			continue;
+		if (n + pfonts[i].gn > sz) {
+			cw = mextend(cw, sz, n + 256, sizeof(cw[0]) * 2);
+			sz = n + 256;
+		}
+		for (j = 0; j < 256; j++) {
+			if (!pfonts[i].gl[j])
+				continue;
+			cw[n * 2] = pfonts[i].gc[j];
+			cw[n * 2 + 1] = pfonts[i].gw[j];
+			n++;
+		}
+	}
+	qsort(cw, n, sizeof(cw[0]) * 2, (void *) cidcmp);
+	/* glyphs may appear in more than one subfont */
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && cw[i * 2] == cw[j * 2 - 2])
+			continue;
+		cw[j * 2] = cw[i * 2];
+		cw[j * 2 + 1] = cw[i * 2 + 1];
+		j++;
+	}
+	n = j;
+	sb = sbuf_make();
+	sbuf_str(sb, "<<\n");
+	sbuf_str(sb, "  /Type /Font\n");
+	sbuf_str(sb, "  /Subtype /CIDFontType2\n");
+	sbuf_printf(sb, "  /BaseFont /%s\n", ps->name);
+	sbuf_str(sb, "  /CIDSystemInfo <</Ordering(Identity)/Registry(Adobe)/Supplement 0>>\n");
+	sbuf_printf(sb, "  /FontDescriptor %d 0 R\n", ps->des);
+	sbuf_str(sb, "  /DW 1000\n");
+	sbuf_str(sb, "  /W [");
+	for (i = 0; i < n; i = j) {
+		/* c_first c_last w for runs of equal widths */
+		j = cw_run(cw, n, i);
+		if (j - i > 2) {
+			sbuf_chr(sb, ' ');
+			sbuf_int(sb, cw[i * 2]);
+			sbuf_chr(sb, ' ');
+			sbuf_int(sb, cw[j * 2 - 2]);
+			sbuf_chr(sb, ' ');
+			sbuf_int(sb, cw[i * 2 + 1]);
+			continue;
+		}
+		/* c [w1 w2 ...] for consecutive CIDs */
+		sbuf_chr(sb, ' ');
+		sbuf_int(sb, cw[i * 2]);
+		sbuf_str(sb, " [");
+		for (j = i; j < n; j++) {
+			if (j > i && (cw[j * 2] != cw[j * 2 - 2] + 1 || cw_run(cw, n, j) - j > 2))
+				break;
+			sbuf_chr(sb, ' ');
+			sbuf_int(sb, cw[j * 2 + 1]);
+		}
+		sbuf_str(sb, " ]");
+	}
+	sbuf_str(sb, " ]\n");
+	sbuf_str(sb, ">>\n");
+	obj_beg(ps->cidfont, 0);
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
+	obj_end();
+	sbuf_free(sb);
+	free(cw);
+}
+
+/* write the CMap mapping one-byte codes of a CID subfont to CIDs */
+static int pfont_writecmap(struct pfont *ps)
+{
+	struct sbuf *sb = sbuf_make();
+	char cmap[256];
+	int rbeg[256], rend[256];	/* code ranges mapped to consecutive CIDs */
+	int cbeg[256];			/* single codes */
+	int rn = 0, cn = 0;
+	int cmap_obj;
+	int i, j;
+	snprintf(cmap, sizeof(cmap), "%s.%d", ps->name, ps->sub);
+	sbuf_printf(sb, "/CIDInit /ProcSet findresource begin\n");
+	sbuf_printf(sb, "12 dict begin\n");
+	sbuf_printf(sb, "begincmap\n");
+	sbuf_printf(sb, "/CIDSystemInfo <</Registry (Adobe) /Ordering (Identity) /Supplement 0>> def\n");
+	sbuf_printf(sb, "/CMapName /%s def\n", cmap);
+	sbuf_printf(sb, "/CMapType 1 def\n");
+	sbuf_printf(sb, "1 begincodespacerange\n<00> <ff>\nendcodespacerange\n");
+	for (i = 0; i < 256; i = j) {
+		if (!ps->gl[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < 256 && ps->gl[j]; j++)
+			if (ps->gc[j] != ps->gc[j - 1] + 1)
+				break;
+		if (j - i > 1) {
+			rbeg[rn] = i;
+			rend[rn++] = j - 1;
+		} else {
+			cbeg[cn++] = i;
+		}
+	}
+	/* at most 100 entries in each block */
+	for (i = 0; i < cn; i++) {
+		if (i % 100 == 0)
+			sbuf_printf(sb, "%d begincidchar\n", MIN(100, cn - i));
+		sbuf_printf(sb, "<%02x> %d\n", cbeg[i], ps->gc[cbeg[i]]);
+		if (i % 100 == 99 || i + 1 == cn)
+			sbuf_printf(sb, "endcidchar\n");
+	}
+	for (i = 0; i < rn; i++) {
+		if (i % 100 == 0)
+			sbuf_printf(sb, "%d begincidrange\n", MIN(100, rn - i));
+		sbuf_printf(sb, "<%02x> <%02x> %d\n", rbeg[i], rend[i], ps->gc[rbeg[i]]);
+		if (i % 100 == 99 || i + 1 == rn)
+			sbuf_printf(sb, "endcidrange\n");
+	}
+	sbuf_printf(sb, "endcmap\n");
+	sbuf_printf(sb, "CMapName currentdict /CMap defineresource pop\n");
+	sbuf_printf(sb, "end\nend\n");
+	cmap_obj = obj_beg(0, 1);
 	pdfout("<<\n");
-	pdfout("  /Type /Font\n");
-	pdfout("  /Subtype /CIDFontType2\n");
-	pdfout("  /BaseFont /%s\n", ps->name);
+	pdfout("  /Type /CMap\n");
+	pdfout("  /CMapName /%s\n", cmap);
 	pdfout("  /CIDSystemInfo <</Ordering(Identity)/Registry(Adobe)/Supplement 0>>\n");
-	pdfout("  /FontDescriptor %d 0 R\n", ps->des);
-	pdfout("  /DW 1000\n");
-	while (font_glget(fn, gcnt))
-		gcnt++;
-	pdfout("  /W [ %d [", ps->gbeg);
-	for (i = ps->gbeg; i <= ps->gend; i++)
-		pdfout(" %d", (long long) font_glget(fn, i)->wid * 100 * 72 / dev_res);
-	pdfout(" ] ]\n");
+	pdfout("  /Length %d\n", sbuf_len(sb));
 	pdfout(">>\n");
+	pdfout("stream\n");
+	pdfmem(sbuf_buf(sb), sbuf_len(sb));
+	pdfout("endstream\n");
 	obj_end();
-	/* the font object */
-	obj_beg(ps->obj);
+	sbuf_free(sb);
+	return cmap_obj;
+}
+
+/* write the object corresponding to this CID font */
+static void pfont_writecid(struct pfont *ps)
+{
+	int cmap_obj = pfont_writecmap(ps);
+	obj_beg(ps->obj, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /Font\n");
 	pdfout("  /Subtype /Type0\n");
 	pdfout("  /BaseFont /%s\n", ps->name);
-	pdfout("  /Encoding /Identity-H\n");
-	pdfout("  /DescendantFonts [%d 0 R]\n", cid_obj);
+	pdfout("  /Encoding %d 0 R\n", cmap_obj);
+	pdfout("  /DescendantFonts [%d 0 R]\n", pfonts[ps->base].cidfont);
 	pdfout(">>\n");
 	obj_end();
-	font_close(fn);
 }
 
 /* write font descriptor; returns its object ID */
@@ -228,6 +638,7 @@ static int writedesc(struct font *fn)
 	int str_obj = -1;
 	int des_obj;
 	char buf[1 << 10];
+	char key[1 << 8];
 	int fntype = fonttype(font_path(fn));
 	if (fntype == '1' || fntype == 't') {
 		int fd = open(font_path(fn), O_RDONLY);
@@ -239,6 +650,27 @@ static int writedesc(struct font *fn)
 		while ((nr = read(fd, buf, sizeof(buf))) > 0)
 			sbuf_mem(ffsb, buf, nr);
 		close(fd);
+		/* extract the face from TrueType collections */
+		if (fntype == 't') {
+			struct sbuf *face = sbuf_make();
+			if (!sfnt_face(sbuf_buf(ffsb), sbuf_len(ffsb), font_name(fn), face)) {
+				sbuf_free(ffsb);
+				ffsb = face;
+			} else {
+				sbuf_free(face);
+			}
+		}
+		/* convert Type 1 fonts to CFF; fntype 'c' marks converted fonts */
+		if (fntype == '1' && pdf_cff) {
+			struct sbuf *cff = sbuf_make();
+			if (!cff_type1(sbuf_buf(ffsb), sbuf_len(ffsb), cff)) {
+				sbuf_free(ffsb);
+				ffsb = cff;
+				fntype = 'c';
+			} else {
+				sbuf_free(cff);
+			}
+		}
 		l1 = sbuf_len(ffsb);
 		/* initialize Type 1 lengths */
 		if (fntype == '1') {
@@ -251,15 +683,20 @@ static int writedesc(struct font *fn)
 			l1 -= l3;
 			l3 = 0;
 		}
-		/* encoding file contents */
-		encodehex(sb, sbuf_buf(ffsb), sbuf_len(ffsb));
+		/* fonts with identical contents share font programs */
+		pdf_digest(key, sbuf_buf(ffsb), sbuf_len(ffsb));
+		str_obj = dict_get(pdf_fontfile, key);
 		/* write font data if it has nonzero length */
-		if (l1) {
-			str_obj = obj_beg(0);
+		if (str_obj < 0 && l1) {
+			flate_deflate(sbuf_buf(ffsb), sbuf_len(ffsb), sb);
+			str_obj = obj_beg(0, 1);
 			pdfout("<<\n");
-			pdfout("  /Filter /ASCIIHexDecode\n");
+			pdfout("  /Filter /FlateDecode\n");
 			pdfout("  /Length %d\n", sbuf_len(sb));
-			pdfout("  /Length1 %d\n", l1);
+			if (fntype == 'c')
+				pdfout("  /Subtype /Type1C\n");
+			else
+				pdfout("  /Length1 %d\n", l1);
 			if (fntype == '1')
 				pdfout("  /Length2 %d\n", l2);
 			if (fntype == '1')
@@ -267,14 +704,18 @@ static int writedesc(struct font *fn)
 			pdfout(">>\n");
 			pdfout("stream\n");
 			pdfmem(sbuf_buf(sb), sbuf_len(sb));
-			pdfout("endstream\n");
+			pdfout("\nendstream\n");
 			obj_end();
+			dict_put(pdf_fontfile, key, str_obj);
 		}
 		sbuf_free(ffsb);
 		sbuf_free(sb);
 	}
-	/* the font descriptor */
-	des_obj = obj_beg(0);
+	/* the font descriptor; shared if both the program and name match */
+	snprintf(key, sizeof(key), "%d %s", str_obj, font_name(fn));
+	if ((des_obj = dict_get(pdf_fontdesc, key)) >= 0)
+		return des_obj;
+	des_obj = obj_beg(0, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /FontDescriptor\n");
 	pdfout("  /FontName /%s\n", font_name(fn));
@@ -288,23 +729,98 @@ static int writedesc(struct font *fn)
 	pdfout("  /Descent 100\n");
 	if (str_obj >= 0)
 		pdfout("  /FontFile%s %d 0 R\n",
-			fntype == 't' ? "2" : "", str_obj);
+			fntype == 't' ? "2" : (fntype == 'c' ? "3" : ""), str_obj);
 	pdfout(">>\n");
 	obj_end();
+	dict_put(pdf_fontdesc, key, des_obj);
 	return des_obj;
 }
 
+/* the key of glyph g in gmap: its name or, for CID fonts, its CID */
+static char *pfont_gkey(int cid, struct glyph *g)
+{
+	static char buf[32];
+	if (!cid)
+		return g->id;
+	sprintf(buf, "%d", font_glnum(g->font, g));
+	return buf;
+}
+
+/* map code c of subfont i to glyph g */
+static void pfont_setcode(int i, int c, struct glyph *g)
+{
+	struct pfont *ps = &pfonts[i];
+	struct dict *gmap = pfonts[ps->base].gmap;
+	char *key = pfont_gkey(ps->cid, g);
+	if (dict_get(gmap, key) < 0)
+		dict_put(gmap, key, ps->sub * 256 + c);
+	ps->gl[c] = dict_key(gmap, dict_idx(gmap, key));
+	ps->gc[c] = font_glnum(g->font, g);
+	ps->gw[c] = (long long) g->wid * 100 * 72 / dev_res;
+}
+
+/* allocate the next code of subfont i for glyph g */
+static void pfont_addglyph(int i, struct glyph *g)
+{
+	pfont_setcode(i, PCODE(pfonts[i].gn), g);
+	pfonts[i].gn++;
+}
+
+/* map code 32 of subfont i to the space glyph of fn; returns nonzero if missing */
+static int pfont_space(int i, struct font *fn)
+{
+	struct glyph *g;
+	if (pfonts[i].gl[32])
+		return 0;
+	if (!(g = font_glyph(fn, "space")))
+		return 1;
+	pfont_setcode(i, 32, g);
+	return 0;
+}
+
+/* the code of glyph g in the given subfont */
+static int pfont_code(int i, struct glyph *g)
+{
+	return dict_get(pfonts[pfonts[i].base].gmap, pfont_gkey(pfonts[i].cid, g)) & 0xff;
+}
+
+/*
+ * find the subfont containing glyph g
+ *
+ * Glyphs are assigned one-byte codes in the order of their first
+ * use; a new subfont is created when the last one has no free codes.
+ * The subfonts of CID fonts map their codes to CIDs via a CMap and
+ * share a CIDFont.
+ */
 static int pfont_find(struct glyph *g)
 {
 	struct font *fn = g->font;
 	char *name = font_name(fn);
 	struct pfont *ps = NULL;
 	int fntype = fonttype(font_path(fn));
-	int sub = fntype == '1' ? font_glnum(fn, g) / 256 : 0;
+	int base = -1, last = -1;
+	int sub = 0;
 	int i;
-	for (i = 0; i < pfonts_n; i++)
-		if (!strcmp(name, pfonts[i].name) && pfonts[i].sub == sub)
-			return i;
+	for (i = 0; i < pfonts_n; i++) {
+		if (!strcmp(name, pfonts[i].name)) {
+			if (base < 0)
+				base = i;
+			last = i;
+		}
+	}
+	if (base >= 0) {
+		int code = dict_get(pfonts[base].gmap, pfont_gkey(pfonts[base].cid, g));
+		if (code >= 0) {
+			for (i = base; i < pfonts_n; i++)
+				if (!strcmp(name, pfonts[i].name) && pfonts[i].sub == code >> 8)
+					return i;
+		}
+		if (pfonts[last].gn < 255) {
+			pfont_addglyph(last, g);
+			return last;
+		}
+		sub = pfonts[last].sub + 1;
+	}
 	if (pfonts_n == pfonts_sz) {
 		pfonts_sz += 16;
 		pfonts = mextend(pfonts, pfonts_n,
@@ -317,14 +833,12 @@ static int pfont_find(struct glyph *g)
 	ps->cid = fntype == 't';
 	ps->obj = obj_map();
 	ps->sub = sub;
-	ps->gbeg = 1 << 20;
-	for (i = 0; i < pfonts_n; i++)
-		if (!strcmp(pfonts[i].name, ps->name))
-			break;
-	if (i < pfonts_n)
-		ps->des = pfonts[i].des;
-	else
-		ps->des = writedesc(fn);
+	ps->base = base >= 0 ? base : pfonts_n;
+	ps->gmap = base >= 0 ? NULL : dict_make(-1, 1, 0);
+	ps->cidfont = ps->cid && base < 0 ? obj_map() : 0;
+	ps->gn = 0;
+	ps->des = base >= 0 ? pfonts[base].des : writedesc(fn);
+	pfont_addglyph(pfonts_n, g);
 	return pfonts_n++;
 }
 
@@ -332,112 +846,244 @@ static void pfont_done(void)
 {
 	int i;
 	for (i = 0; i < pfonts_n; i++) {
+		if (pfonts[i].cid && pfonts[i].base == i)
+			pfont_writecidfont(i);
 		if (pfonts[i].cid)
 			pfont_writecid(&pfonts[i]);
 		else
 			pfont_write(&pfonts[i]);
 	}
+	for (i = 0; i < pfonts_n; i++)
+		if (pfonts[i].gmap)
+			dict_free(pfonts[i].gmap);
 	free(pfonts);
 }
 
+/* write queued glyph codes as a literal or hexadecimal string */
+static void o_strout(void)
+{
+	int lit = 0, depth = 0, paren = 0;
+	int i;
+	if (!o_str_n)
+		return;
+	/* balanced parentheses need no escapes */
+	for (i = 0; i < o_str_n && depth >= 0; i++)
+		depth += (o_str[i] == '(') - (o_str[i] == ')');
+	paren = depth != 0;
+	for (i = 0; i < o_str_n; i++) {
+		int c = (unsigned char) o_str[i];
+		lit += c < 32 || c == 127 ? 4 : 1;
+		lit += c == '\\' || (paren && (c == '(' || c == ')'));
+	}
+	if (lit <= o_str_n * 2) {
+		sbuf_chr(pg, '(');
+		for (i = 0; i < o_str_n; i++) {
+			int c = (unsigned char) o_str[i];
+			if (c < 32 || c == 127) {
+				sbuf_chr(pg, '\\');
+				sbuf_chr(pg, '0' + (c >> 6));
+				sbuf_chr(pg, '0' + ((c >> 3) & 7));
+				sbuf_chr(pg, '0' + (c & 7));
+			} else {
+				if (c == '\\' || (paren && (c == '(' || c == ')')))
+					sbuf_chr(pg, '\\');
+				sbuf_chr(pg, c);
+			}
+		}
+		sbuf_chr(pg, ')');
+	} else {
+		sbuf_chr(pg, '<');
+		sbuf_hex(pg, o_str, o_str_n);
+		sbuf_chr(pg, '>');
+	}
+	o_str_n = 0;
+}
+
 static void o_flush(void)
 {
-	if (o_queued == 1)
-		sbuf_printf(pg, ">] TJ\n");
+	if (o_queued == 1) {
+		o_strout();
+		sbuf_str(pg, "]TJ\n");
+	}
 	o_queued = 0;
 }
 
+/* BT resets the text matrix */
+static void o_textbeg(void)
+{
+	t_h = 0;
+	t_v = pdf_vh;
+	p_x = 0;
+	p_v = -1;
+}
+
 static int o_loadfont(struct glyph *g)
 {
 	int fn = pfont_find(g);
-	o_iset[fn] = 1;
+	if (pfonts[fn].page != page_n + 1) {
+		pfonts[fn].page = page_n + 1;
+		if (o_fonts_n == o_fonts_sz) {
+			o_fonts_sz = o_fonts_sz ? o_fonts_sz * 2 : 64;
+			o_fonts = mextend(o_fonts, o_fonts_n, o_fonts_sz, sizeof(o_fonts[0]));
+		}
+		o_fonts[o_fonts_n++] = fn;
+	}
 	return fn;
 }
 
-/* like pdfpos() but assume that uh and uv are multiplied by 100 */
-static char *pdfpos00(int uh, int uv)
+/*
+ * append troff position as pdf position
+ *
+ * Page contents use basic units, with the origin at the bottom-left
+ * corner of the page; see docpagebeg().
+ */
+static void pdfpos(struct sbuf *sb, int uh, int uv)
+{
+	sbuf_int(sb, uh);
+	sbuf_chr(sb, ' ');
+	sbuf_int(sb, pdf_vh - uv);
+}
+
+/* troff position in points, used outside page contents */
+static char *pdfpt(int uh, int uv)
 {
 	static char buf[64];
-	int h = (long long) uh * 72 / dev_res;
-	int v = (long long) pdf_height * 100 - (long long) uv * 72 / dev_res;
+	int h = (long long) uh * 7200 / dev_res;
+	int v = (long long) pdf_height * 100 - (long long) uv * 7200 / dev_res;
 	sprintf(buf, "%s%d.%02d %s%d.%02d",
 		h < 0 ? "-" : "", abs(h) / 100, abs(h) % 100,
 		v < 0 ? "-" : "", abs(v) / 100, abs(v) % 100);
 	return buf;
 }
 
-/* convert troff position to pdf position; returns a static buffer */
-static char *pdfpos(int uh, int uv)
+/* append troff color as pdf color and the given operator */
+static void pdfcolor(struct sbuf *sb, int m, char *op)
 {
-	return pdfpos00(uh * 100, uv * 100);
+	sbuf_dec(sb, CLR_R(m) * 1000 / 255, 1000);
+	sbuf_chr(sb, ' ');
+	sbuf_dec(sb, CLR_G(m) * 1000 / 255, 1000);
+	sbuf_chr(sb, ' ');
+	sbuf_dec(sb, CLR_B(m) * 1000 / 255, 1000);
+	sbuf_str(sb, op);
 }
 
-/* troff length to thousands of a unit of text space; returns a static buffer */
-static char *pdfunit(int uh, int sz)
+/* n / d rounded to the nearest integer */
+static long long o_div(long long n, long long d)
 {
-	static char buf[64];
-	int h = (long long) uh * 1000 * 72 / sz / dev_res;
-	sprintf(buf, "%s%d", h < 0 ? "-" : "", abs(h));
-	return buf;
+	return n >= 0 ? (n + d / 2) / d : -((-n + d / 2) / d);
 }
 
-/* convert troff color to pdf color; returns a static buffer */
-static char *pdfcolor(int m)
+/* queue a glyph code and advance the pen as PDF viewers do */
+static void o_queuecode(int c)
 {
-	static char buf[64];
-	int r = CLR_R(m) * 1000 / 255;
-	int g = CLR_G(m) * 1000 / 255;
-	int b = CLR_B(m) * 1000 / 255;
-	sbuf_printf(pg, "%d.%03d %d.%03d %d.%03d",
-		r / 1000, r % 1000, g / 1000, g % 1000, b / 1000, b % 1000);
-	return buf;
+	if (o_str_n == sizeof(o_str))
+		o_strout();
+	o_str[o_str_n++] = c;
+	/* a thousandth of text space is o_s * dev_res in pen units */
+	p_x += (long long) pfonts[o_i].gw[c] * o_s * dev_res;
+	if (c == 32)
+		p_x += t_w;
+}
+
+/*
+ * move the pen to o_h
+ *
+ * Word spaces are written as code 32, adjusting the word spacing
+ * (Tw) if necessary, and other moves as TJ adjustments.
+ */
+static void o_hmove(struct glyph *g)
+{
+	long long d = PEN(o_h) - p_x;
+	long long s1 = (long long) o_s * dev_res;
+	long long sw, gap;
+	int wg = o_h - p_h;
+	if (d > 0 && !pfont_space(o_i, g->font)) {
+		sw = pfonts[o_i].gw[32] * s1;
+		/* the spaces of justified lines differ by at most one unit */
+		if ((d - sw - t_w > PENTOL || sw + t_w - d > PENTOL) &&
+				d > sw / 2 && d < sw * 4 && abs(wg - t_gap) <= 1) {
+			gap = (PEN(wg) + PEN(t_gap)) / 2;
+			/* the closest word spacing placing this word within PENTOL */
+			gap = MAX(gap, d - PENTOL + PEN(1) / 100);
+			gap = MIN(gap, d + PENTOL - PEN(1) / 100);
+			/* word spacing in hundredths of basic units */
+			t_w = o_div(gap - sw, PEN(1) / 100) * (PEN(1) / 100);
+			o_flush();
+			sbuf_dec(pg, t_w, PEN(1));
+			sbuf_str(pg, " Tw\n[");
+			o_queued = 1;
+		}
+		if (d > sw / 2 && d < sw * 4)
+			t_gap = wg;
+		if (d - sw - t_w <= PENTOL && sw + t_w - d <= PENTOL) {
+			o_queuecode(32);
+			return;
+		}
+	}
+	o_strout();
+	sbuf_int(pg, -o_div(d, s1));
+	p_x += o_div(d, s1) * s1;
 }
 
 static void o_queue(struct glyph *g)
 {
-	int gid;
 	if (o_v != p_v) {
+		/* moving to the next line, relative to the start of this line */
+		int dh = o_h - t_h;
+		int dv = t_v - o_v;
 		o_flush();
-		sbuf_printf(pg, "1 0 0 1 %s Tm\n", pdfpos(o_h, o_v));
+		if (f_op >= 0)
+			f_bad = 1;
+		f_op = sbuf_len(pg);
+		f_h = o_h;
+		f_v = o_v;
+		if (!dh && dv == -t_l) {
+			sbuf_str(pg, "T*\n");
+		} else {
+			sbuf_int(pg, dh);
+			sbuf_chr(pg, ' ');
+			sbuf_int(pg, dv);
+			sbuf_str(pg, dv ? " TD\n" : " Td\n");
+		}
+		if (dv)
+			t_l = -dv;
+		f_opend = sbuf_len(pg);
+		t_h = o_h;
+		t_v = o_v;
+		p_x = PEN(o_h);
 		p_h = o_h;
 		p_v = o_v;
 	}
 	if (!o_queued)
-		sbuf_printf(pg, "[<");
+		sbuf_chr(pg, '[');
 	o_queued = 1;
-	if (o_h != p_h)
-		sbuf_printf(pg, "> %s <", pdfunit(p_h - o_h, o_s));
-	/* printing glyph identifier */
-	gid = font_glnum(g->font, g);
-	if (pfonts[o_i].cid)
-		sbuf_printf(pg, "%04x", gid);
-	else
-		sbuf_printf(pg, "%02x", gid % 256);
-	/* updating gbeg and gend */
-	if (gid < pfonts[o_i].gbeg)
-		pfonts[o_i].gbeg = gid;
-	if (gid > pfonts[o_i].gend)
-		pfonts[o_i].gend = gid;
-	/* advancing */
+	if (PEN(o_h) - p_x > PENTOL || p_x - PEN(o_h) > PENTOL)
+		o_hmove(g);
+	o_queuecode(pfont_code(o_i, g));
 	p_h = o_h + font_wid(g->font, o_s, g->wid);
 }
 
+static void drawflush(void);
+static void frag_end(void);
+
 static void out_fontup(void)
 {
-	if (o_m != p_m) {
+	drawflush();
+	if (gs_set(GS_FILL, o_m)) {
 		o_flush();
-		sbuf_printf(pg, "%s rg\n", pdfcolor(o_m));
-		p_m = o_m;
+		pdfcolor(pg, o_m, " rg\n");
 	}
-	if (o_i >= 0 && (o_i != p_i || o_s != p_s)) {
-		struct pfont *ps = &pfonts[o_i];
+	if (o_i >= 0 && (gs_set(GS_FONT, o_i) | gs_set(GS_SIZE, o_s))) {
 		o_flush();
-		if (ps->cid)
-			sbuf_printf(pg, "/%s %d Tf\n", ps->name, o_s);
-		else
-			sbuf_printf(pg, "/%s.%d %d Tf\n", ps->name, ps->sub, o_s);
-		p_i = o_i;
-		p_s = o_s;
+		/* font size in basic units */
+		sbuf_str(pg, "/F");
+		sbuf_int(pg, o_i);
+		sbuf_chr(pg, ' ');
+		sbuf_dec(pg, (long long) o_s * dev_res, 72);
+		sbuf_str(pg, " Tf\n");
+		if (f_fonts_n < LEN(f_fonts))
+			f_fonts[f_fonts_n] = o_i;
+		f_fonts_n++;
 	}
 }
 
@@ -452,8 +1098,14 @@ void outc(char *c)
 		return;
 	}
 	o_i = o_loadfont(g);
+	if (o_v != p_v) {		/* a new line starts a page fragment */
+		o_flush();
+		drawflush();
+		frag_end();
+	}
 	out_fontup();
 	o_queue(g);
+	pg_stream();
 }
 
 void outh(int h)
@@ -511,14 +1163,18 @@ static char *pdf_copy(char *pdf, int len, int pos)
 	return buf;
 }
 
-static void pdf_dictcopy(char *pdf, int len, int pos, struct sbuf *sb);
+static void pdf_valcopy(struct pdoc *pd, int pos, struct sbuf *sb);
+static int pdf_objwrite(struct pdoc *pd, int obj, int pos);
+static int copy_depth;		/* the nesting depth of copied containers and references */
 
 /* write stream to sb */
-static int pdf_strcopy(char *pdf, int len, int pos, struct sbuf *sb)
+static int pdf_strcopy(struct pdf *doc, int pos, struct sbuf *sb)
 {
-	int slen, val;
-	int beg;
-	if ((val = pdf_dval_val(pdf, len, pos, "/Length")) < 0)
+	char *pdf = pdf_data(doc);
+	int val = pdf_dval_val(doc, pos, "/Length");
+	int len = pdf_size(doc);
+	int slen, beg;
+	if (val < 0)
 		return -1;
 	slen = atoi(pdf + val);
 	pos = pos + pdf_len(pdf, len, pos);
@@ -539,72 +1195,141 @@ static int pdf_strcopy(char *pdf, int len, int pos, struct sbuf *sb)
 	return 0;
 }
 
-/* copy a PDF object and return its new identifier */
-static int pdf_objcopy(char *pdf, int len, int pos)
+/*
+ * copy a referenced PDF object and return its new identifier
+ *
+ * Each object of an included file is copied once; the identifier
+ * of an object that is referenced while being copied (a cycle)
+ * is allocated before its definition.  Other objects are shared
+ * with objects copied from other files, if their digests (see
+ * pdf_digest()) match; since references are resolved before writing
+ * an object, identical subgraphs (like the same embedded font in
+ * different figures) are written once.
+ */
+static int pdf_objcopy(struct pdoc *pd, int pos)
 {
-	int id;
-	if ((pos = pdf_ref(pdf, len, pos)) < 0)
+	struct pdf *doc = pd->pdf;
+	char *pdf = pdf_data(doc);
+	int len = pdf_size(doc);
+	int obj, rev;
+	if (pdf_obj(pdf, len, pos, &obj, &rev) || (pos = pdf_find(doc, obj, rev)) < 0)
 		return -1;
-	if (pdf_type(pdf, len, pos) == 'd') {
-		struct sbuf *sb = sbuf_make();
-		pdf_dictcopy(pdf, len, pos, sb);
-		sbuf_chr(sb, '\n');
-		if (pdf_dval(pdf, len, pos, "/Length") >= 0)
-			pdf_strcopy(pdf, len, pos, sb);
-		id = obj_beg(0);
+	if (obj >= pd->ids_n) {
+		int n = obj + 256;
+		pd->ids = mextend(pd->ids, pd->ids_n, n, sizeof(pd->ids[0]));
+		pd->ids_n = n;
+	}
+	if (pd->ids[obj] > 0)
+		return pd->ids[obj];
+	if (pd->ids[obj] < 0) {
+		pd->ids[obj] = obj_map();
+		return pd->ids[obj];
+	}
+	/* long chains of references are copied later by pdf_valcopy() */
+	if (copy_depth >= 256) {
+		if (pd->todo_n + 2 > pd->todo_sz) {
+			pd->todo_sz += 256;
+			pd->todo = mextend(pd->todo, pd->todo_n, pd->todo_sz, sizeof(pd->todo[0]));
+		}
+		pd->todo[pd->todo_n++] = obj;
+		pd->todo[pd->todo_n++] = pos;
+		pd->ids[obj] = obj_map();
+		return pd->ids[obj];
+	}
+	pd->ids[obj] = -1;
+	pd->ids[obj] = pdf_objwrite(pd, obj, pos);
+	return pd->ids[obj];
+}
+
+/* write object obj at pos; its identifier is pd->ids[obj], if allocated */
+static int pdf_objwrite(struct pdoc *pd, int obj, int pos)
+{
+	struct pdf *doc = pd->pdf;
+	char *pdf = pdf_data(doc);
+	struct sbuf *sb = sbuf_make();
+	int id, len, stream = 0;
+	copy_depth++;
+	pdf_valcopy(pd, pos, sb);
+	copy_depth--;
+	sbuf_chr(sb, '\n');
+	len = pdf_size(doc);	/* copying may have decoded object streams */
+	if (pdf_type(pdf, len, pos) == 'd' && pdf_dval(pdf, len, pos, "/Length") >= 0)
+		stream = !pdf_strcopy(doc, pos, sb);
+	if (pd->ids[obj] > 0) {
+		id = obj_beg(pd->ids[obj], stream);
 		pdfmem(sbuf_buf(sb), sbuf_len(sb));
 		obj_end();
-		sbuf_free(sb);
 	} else {
-		id = obj_beg(0);
-		pdfmem(pdf + pos, pdf_len(pdf, len, pos));
-		pdfout("\n");
-		obj_end();
+		id = obj_shared(sb, stream);
 	}
+	sbuf_free(sb);
 	return id;
 }
 
-/* copy a PDF dictionary recursively */
-static void pdf_dictcopy(char *pdf, int len, int pos, struct sbuf *sb)
+/* copy a PDF value, copying the objects it references */
+static void pdf_valcopy(struct pdoc *pd, int pos, struct sbuf *sb)
 {
+	char *pdf = pdf_data(pd->pdf);
+	int len = pdf_size(pd->pdf);
+	int type = pdf_type(pdf, len, pos);
+	int *items;
+	int id, n;
 	int i;
-	int key, val, id;
-	sbuf_printf(sb, "<<");
-	for (i = 0; ; i++) {
-		if ((key = pdf_dkey(pdf, len, pos, i)) < 0)
-			break;
-		sbuf_printf(sb, " %s", pdf_copy(pdf, len, key));
-		val = pdf_dval(pdf, len, pos, pdf_copy(pdf, len, key));
-		if (pdf_type(pdf, len, val) == 'r') {
-			if ((id = pdf_objcopy(pdf, len, val)) >= 0)
-				sbuf_printf(sb, " %d 0 R", id);
-		} else {
-			sbuf_printf(sb, " %s", pdf_copy(pdf, len, val));
+	pos += pdf_ws(pdf, len, pos);
+	if (type == 'r') {
+		if ((id = pdf_objcopy(pd, pos)) >= 0)
+			sbuf_printf(sb, "%d 0 R", id);
+		else
+			sbuf_str(sb, "null");
+	} else if ((type == 'd' || type == 'l') && copy_depth < 256) {
+		n = pdf_span(pdf, len, pos, &items, NULL, 0);
+		copy_depth++;
+		sbuf_str(sb, type == 'd' ? "<<" : "[");
+		for (i = 0; i < n; i++) {
+			sbuf_chr(sb, ' ');
+			if (type == 'd' && i % 2 == 0)
+				sbuf_mem(sb, pdf + items[i], pdf_len(pdf, len, items[i]));
+			else
+				pdf_valcopy(pd, items[i], sb);
 		}
+		sbuf_str(sb, type == 'd' ? " >>" : " ]");
+		copy_depth--;
+		free(items);
+	} else if (type == 'd' || type == 'l') {
+		sbuf_str(sb, "null");
+	} else {
+		sbuf_mem(sb, pdf + pos, pdf_len(pdf, len, pos));
+	}
+	/* the outermost call copies the objects postponed by pdf_objcopy() */
+	while (!copy_depth && pd->todo_n > 0) {
+		pos = pd->todo[--pd->todo_n];
+		n = pd->todo[--pd->todo_n];
+		pdf_objwrite(pd, n, pos);
 	}
-	sbuf_printf(sb, " >>");
 }
 
 /* copy resources dictionary */
-static void pdf_rescopy(char *pdf, int len, int pos, struct sbuf *sb)
+static void pdf_rescopy(struct pdoc *pd, int pos, struct sbuf *sb)
 {
 	char *res_fields[] = {"/ProcSet", "/ExtGState", "/ColorSpace",
 		"/Pattern", "/Shading", "/Properties", "/Font", "/XObject"};
-	int res, i;
+	int buf[64];
+	int *items;
+	int res, i, n;
+	n = pdf_span(pdf_data(pd->pdf), pdf_size(pd->pdf), pos, &items, buf, LEN(buf));
+	if (pdf_type(pdf_data(pd->pdf), pdf_size(pd->pdf), pos) != 'd')
+		n = 0;
 	sbuf_printf(sb, "  /Resources <<\n");
 	for (i = 0; i < LEN(res_fields); i++) {
-		if ((res = pdf_dval_val(pdf, len, pos, res_fields[i])) >= 0) {
-			if (pdf_type(pdf, len, res) == 'd') {
-				sbuf_printf(sb, "    %s ", res_fields[i]);
-				pdf_dictcopy(pdf, len, res, sb);
-				sbuf_printf(sb, "\n");
-			} else {
-				sbuf_printf(sb, "    %s %s\n", res_fields[i],
-					pdf_copy(pdf, len, res));
-			}
+		if ((res = pdf_dget_val(pd->pdf, items, n, res_fields[i])) >= 0) {
+			sbuf_printf(sb, "    %s ", res_fields[i]);
+			pdf_valcopy(pd, res, sb);
+			sbuf_printf(sb, "\n");
 		}
 	}
 	sbuf_printf(sb, "  >>\n");
+	if (items != buf)
+		free(items);
 }
 
 static int pdfbbox100(char *pdf, int len, int pos, int dim[4])
@@ -629,40 +1354,57 @@ static int pdfbbox100(char *pdf, int len, int pos, int dim[4])
 	return 0;
 }
 
-static int pdfext(char *pdf, int len, int hwid, int vwid)
+/* create a Form XObject from the first page of pd; returns its object ID */
+static int pdfext(struct pdoc *pd, int hwid, int vwid)
 {
+	struct pdf *doc = pd->pdf;
+	char *pdf = pdf_data(doc);	/* pdf_size() grows as object streams are decoded */
 	char *cont_fields[] = {"/Filter", "/DecodeParms"};
 	int trailer, root, cont, pages, page1, res;
 	int kids_val, page1_val, val, bbox;
 	int xobj_id, length;
 	int dim[4];
 	int hzoom = 100, vzoom = 100;
+	int buf[64], cbuf[64];
+	int *items, *citems;
+	int n, cn;
 	struct sbuf *sb;
 	int i;
-	if (xobj_n == LEN(xobj))
+	if ((trailer = pdf_trailer(doc)) < 0)
 		return -1;
-	if ((trailer = pdf_trailer(pdf, len)) < 0)
+	if ((root = pdf_dval_obj(doc, trailer, "/Root")) < 0)
 		return -1;
-	if ((root = pdf_dval_obj(pdf, len, trailer, "/Root")) < 0)
+	if ((pages = pdf_dval_obj(doc, root, "/Pages")) < 0)
 		return -1;
-	if ((pages = pdf_dval_obj(pdf, len, root, "/Pages")) < 0)
+	if ((kids_val = pdf_dval_val(doc, pages, "/Kids")) < 0)
 		return -1;
-	if ((kids_val = pdf_dval_val(pdf, len, pages, "/Kids")) < 0)
+	if ((page1_val = pdf_lval(pdf, pdf_size(doc), kids_val, 0)) < 0)
 		return -1;
-	if ((page1_val = pdf_lval(pdf, len, kids_val, 0)) < 0)
+	if ((page1 = pdf_ref(doc, page1_val)) < 0)
 		return -1;
-	if ((page1 = pdf_ref(pdf, len, page1_val)) < 0)
+	if (pdf_type(pdf, pdf_size(doc), page1) != 'd')
 		return -1;
-	if ((cont = pdf_dval_obj(pdf, len, page1, "/Contents")) < 0)
+	/* the page and its contents stream are looked up in item tables */
+	n = pdf_span(pdf, pdf_size(doc), page1, &items, buf, LEN(buf));
+	cont = pdf_dget(pdf, pdf_size(doc), items, n, "/Contents");
+	if (cont >= 0)
+		cont = pdf_ref(doc, cont);
+	res = pdf_dget_val(doc, items, n, "/Resources");
+	bbox = pdf_dget_val(doc, items, n, "/MediaBox");
+	if (items != buf)
+		free(items);
+	if (cont < 0 || pdf_type(pdf, pdf_size(doc), cont) != 'd')
 		return -1;
-	if ((val = pdf_dval_val(pdf, len, cont, "/Length")) < 0)
+	cn = pdf_span(pdf, pdf_size(doc), cont, &citems, cbuf, LEN(cbuf));
+	if ((val = pdf_dget_val(doc, citems, cn, "/Length")) < 0) {
+		if (citems != cbuf)
+			free(citems);
 		return -1;
-	res = pdf_dval_val(pdf, len, page1, "/Resources");
+	}
 	length = atoi(pdf + val);
-	bbox = pdf_dval_val(pdf, len, page1, "/MediaBox");
 	if (bbox < 0)
-		bbox = pdf_dval_val(pdf, len, pages, "/MediaBox");
-	if (bbox >= 0 && !pdfbbox100(pdf, len, bbox, dim)) {
+		bbox = pdf_dval_val(doc, pages, "/MediaBox");
+	if (bbox >= 0 && !pdfbbox100(pdf, pdf_size(doc), bbox, dim)) {
 		if (hwid > 0)
 			hzoom = (long long) hwid * (100 * 7200 / dev_res) / (dim[2] - dim[0]);
 		if (vwid > 0)
@@ -678,61 +1420,218 @@ static int pdfext(char *pdf, int len, int hwid, int vwid)
 	sbuf_printf(sb, "  /Subtype /Form\n");
 	sbuf_printf(sb, "  /FormType 1\n");
 	if (bbox >= 0)
-		sbuf_printf(sb, "  /BBox %s\n", pdf_copy(pdf, len, bbox));
-	sbuf_printf(sb, "  /Matrix [%d.%02d 0 0 %d.%02d %s]\n",
-		hzoom / 100, hzoom % 100, vzoom / 100, vzoom % 100,
-		pdfpos(o_h, o_v));
+		sbuf_printf(sb, "  /BBox %s\n", pdf_copy(pdf, pdf_size(doc), bbox));
+	sbuf_printf(sb, "  /Matrix [%d.%02d 0 0 %d.%02d 0 0]\n",
+		hzoom / 100, hzoom % 100, vzoom / 100, vzoom % 100);
 	if (res >= 0)
-		pdf_rescopy(pdf, len, res, sb);
+		pdf_rescopy(pd, res, sb);
 	sbuf_printf(sb, "  /Length %d\n", length);
 	for (i = 0; i < LEN(cont_fields); i++)
-		if ((val = pdf_dval_val(pdf, len, cont, cont_fields[i])) >= 0)
+		if ((val = pdf_dget_val(doc, citems, cn, cont_fields[i])) >= 0)
 			sbuf_printf(sb, "  %s %s\n", cont_fields[i],
-				pdf_copy(pdf, len, val));
+				pdf_copy(pdf, pdf_size(doc), val));
+	if (citems != cbuf)
+		free(citems);
 	sbuf_printf(sb, ">>\n");
-	pdf_strcopy(pdf, len, cont, sb);
-	xobj_id = obj_beg(0);
-	pdfmem(sbuf_buf(sb), sbuf_len(sb));
-	obj_end();
+	xobj_id = obj_shared(sb, !pdf_strcopy(doc, cont, sb));
 	sbuf_free(sb);
-	xobj[xobj_n++] = xobj_id;
+	return xobj_id;
+}
+
+/* the index of an XObject in the current page */
+static int xobj_page(int id)
+{
+	if (id >= xobj_idx_sz) {
+		int n = MAX(xobj_idx_sz * 2, id + 256);
+		xobj_idx = mextend(xobj_idx, xobj_idx_sz, n, sizeof(xobj_idx[0]));
+		xobj_idx_sz = n;
+	}
+	if (xobj_idx[id])
+		return xobj_idx[id] - 1;
+	if (xobj_n == xobj_sz) {
+		xobj_sz = xobj_sz ? xobj_sz * 2 : 64;
+		xobj = mextend(xobj, xobj_n, xobj_sz, sizeof(xobj[0]));
+	}
+	xobj[xobj_n] = id;
+	xobj_idx[id] = ++xobj_n;
+	f_bad = 1;
 	return xobj_n - 1;
 }
 
+/* open an included PDF file; parsed files are cached by path and modification time */
+static struct pdoc *pdf_doc(char *path, long mtime)
+{
+	char key[1 << 11];
+	int i;
+	snprintf(key, sizeof(key), "%s %ld", path, mtime);
+	if ((i = dict_get(pdf_docmap, key)) < 0) {
+		if (pdocs_n == pdocs_sz) {
+			pdocs_sz += 16;
+			pdocs = mextend(pdocs, pdocs_n, pdocs_sz, sizeof(pdocs[0]));
+		}
+		i = pdocs_n++;
+		pdocs[i].pdf = pdf_open(path);
+		dict_put(pdf_docmap, key, i);
+	}
+	return pdocs[i].pdf ? &pdocs[i] : NULL;
+}
+
 void outpdf(char *pdf, int hwid, int vwid)
 {
-	char buf[1 << 12];
-	struct sbuf *sb;
+	char key[1 << 11];
+	struct pdoc *doc;
+	struct stat st;
 	int xobj_id;
-	int fd, nr;
-	/* reading the pdf file */
-	sb = sbuf_make();
-	fd = open(pdf, O_RDONLY);
-	while ((nr = read(fd, buf, sizeof(buf))) > 0)
-		sbuf_mem(sb, buf, nr);
-	close(fd);
-	/* the XObject */
-	xobj_id = pdfext(sbuf_buf(sb), sbuf_len(sb), hwid, vwid);
+	/* included files are cached by path, modification time, and size */
+	if (stat(pdf, &st))
+		st.st_mtime = 0;
+	snprintf(key, sizeof(key), "%s %ld %d %d", pdf, (long) st.st_mtime, hwid, vwid);
+	if ((xobj_id = dict_get(pdf_xobjs, key)) < 0) {
+		if ((doc = pdf_doc(pdf, st.st_mtime)))
+			xobj_id = pdfext(doc, hwid, vwid);
+		if (xobj_id >= 0)
+			dict_put(pdf_xobjs, key, xobj_id);
+	}
+	o_flush();
+	out_fontup();
+	if (xobj_id >= 0) {
+		/* included forms expect the initial graphics and text state */
+		sbuf_str(pg, "ET q 1 w 0 J 0 j 0 g 0 G 0 Tw 0 TL ");
+		/* forms are in points */
+		sbuf_dec(pg, dev_res, 72);
+		sbuf_str(pg, " 0 0 ");
+		sbuf_dec(pg, dev_res, 72);
+		sbuf_chr(pg, ' ');
+		pdfpos(pg, o_h, o_v);
+		sbuf_printf(pg, " cm /FO%d Do Q BT\n", xobj_page(xobj_id));
+		o_textbeg();
+	}
+}
+
+/* the dictionary of an image XObject */
+static void pdfimg_dict(struct sbuf *sb, struct img *img, char *cs, int bpc)
+{
+	sbuf_printf(sb, "<<\n");
+	sbuf_printf(sb, "  /Type /XObject\n");
+	sbuf_printf(sb, "  /Subtype /Image\n");
+	sbuf_printf(sb, "  /Width %d\n", img->w);
+	sbuf_printf(sb, "  /Height %d\n", img->h);
+	sbuf_printf(sb, "  /BitsPerComponent %d\n", bpc);
+	if (cs)
+		sbuf_printf(sb, "  /ColorSpace %s\n", cs);
+}
+
+/* the contents of a stream object */
+static void pdfimg_data(struct sbuf *sb, struct sbuf *dat)
+{
+	sbuf_printf(sb, "  /Length %d\n", sbuf_len(dat));
+	sbuf_printf(sb, ">>\n");
+	sbuf_printf(sb, "stream\n");
+	sbuf_mem(sb, sbuf_buf(dat), sbuf_len(dat));
+	sbuf_printf(sb, "\nendstream\n");
+}
+
+/* write an image XObject; identical images are shared */
+static int pdfimg(struct img *img)
+{
+	struct sbuf *sb = sbuf_make();
+	int smask = -1;
+	int id;
+	/* the alpha channel */
+	if (img->alpha) {
+		pdfimg_dict(sb, img, "/DeviceGray", 8);
+		sbuf_printf(sb, "  /Filter /FlateDecode\n");
+		pdfimg_data(sb, img->alpha);
+		smask = obj_shared(sb, 1);
+		sbuf_cut(sb, 0);
+	}
+	if (img->pal) {
+		pdfimg_dict(sb, img, NULL, img->bpc);
+		sbuf_printf(sb, "  /ColorSpace [/Indexed /DeviceRGB %d <",
+			sbuf_len(img->pal) / 3 - 1);
+		encodehex(sb, sbuf_buf(img->pal), sbuf_len(img->pal));
+		sbuf_printf(sb, "  ]\n");
+	} else {
+		pdfimg_dict(sb, img, img->ncomp == 4 ? "/DeviceCMYK" :
+			(img->ncomp == 3 ? "/DeviceRGB" : "/DeviceGray"), img->bpc);
+	}
+	if (img->inv)
+		sbuf_printf(sb, "  /Decode [1 0 1 0 1 0 1 0]\n");
+	if (img->fmt == 'j')
+		sbuf_printf(sb, "  /Filter /DCTDecode\n");
+	if (img->fmt == 'f')
+		sbuf_printf(sb, "  /Filter /FlateDecode\n");
+	if (img->fmt == 'p') {
+		sbuf_printf(sb, "  /Filter /FlateDecode\n");
+		sbuf_printf(sb, "  /DecodeParms << /Predictor 15 /Colors %d "
+			"/BitsPerComponent %d /Columns %d >>\n",
+			img->ncomp, img->bpc, img->w);
+	}
+	if (smask >= 0)
+		sbuf_printf(sb, "  /SMask %d 0 R\n", smask);
+	pdfimg_data(sb, img->dat);
+	id = obj_shared(sb, 1);
 	sbuf_free(sb);
+	return id;
+}
+
+void outimg(char *path, int hwid, int vwid)
+{
+	char key[1 << 11];
+	struct stat st;
+	struct img *img;
+	struct pimg *pi;
+	int i;
+	/* included images are cached by path and modification time */
+	if (stat(path, &st))
+		st.st_mtime = 0;
+	snprintf(key, sizeof(key), "%s %ld", path, (long) st.st_mtime);
+	if ((i = dict_get(pdf_imgmap, key)) < 0) {
+		if (pimgs_n == pimgs_sz) {
+			pimgs_sz += 16;
+			pimgs = mextend(pimgs, pimgs_n, pimgs_sz, sizeof(pimgs[0]));
+		}
+		i = pimgs_n++;
+		pimgs[i].obj = -1;
+		if ((img = img_open(path))) {
+			pimgs[i].obj = pdfimg(img);
+			pimgs[i].w = img->w;
+			pimgs[i].h = img->h;
+			img_free(img);
+		}
+		dict_put(pdf_imgmap, key, i);
+	}
+	pi = &pimgs[i];
+	if (pi->obj < 0)
+		return;
+	/* the image occupies one point per pixel by default */
+	if (hwid <= 0 && vwid <= 0)
+		hwid = pi->w * dev_res / 72;
+	if (vwid <= 0)
+		vwid = (long long) pi->h * hwid / pi->w;
+	if (hwid <= 0)
+		hwid = (long long) pi->w * vwid / pi->h;
 	o_flush();
 	out_fontup();
-	if (xobj_id >= 0)
-		sbuf_printf(pg, "ET /FO%d Do BT\n", xobj_id);
-	p_h = -1;
-	p_v = -1;
+	sbuf_printf(pg, "ET q %d 0 0 %d ", hwid, vwid);
+	pdfpos(pg, o_h, o_v);
+	sbuf_printf(pg, " cm /FO%d Do Q BT\n", xobj_page(pi->obj));
+	o_textbeg();
 }
 
 void outlink(char *lnk, int hwid, int vwid)
 {
-	if (ann_n == LEN(ann))
-		return;
 	o_flush();
-	ann[ann_n++] = obj_beg(0);
+	if (ann_n == ann_sz) {
+		ann_sz = ann_sz ? ann_sz * 2 : 64;
+		ann = mextend(ann, ann_n, ann_sz, sizeof(ann[0]));
+	}
+	ann[ann_n++] = obj_beg(0, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /Annot\n");
 	pdfout("  /Subtype /Link\n");
-	pdfout("  /Rect [%s", pdfpos(o_h, o_v));
-	pdfout(" %s]\n", pdfpos(o_h + hwid, o_v + vwid));
+	pdfout("  /Rect [%s", pdfpt(o_h, o_v));
+	pdfout(" %s]\n", pdfpt(o_h + hwid, o_v + vwid));
 	if (lnk[0] == '#') {	/* internal links */
 		pdfout("  /A << /S /GoTo /D (%s) >>\n", lnk + 1);
 	} else {		/* external links */
@@ -746,7 +1645,7 @@ void outname(int n, char (*desc)[64], int *page, int *off)
 {
 	int i;
 	o_flush();
-	pdf_dests = obj_beg(0);
+	pdf_dests = obj_beg(0, 0);
 	pdfout("<<\n");
 	for (i = 0; i < n; i++) {
 		if (page[i] > 0 && page[i] - 1 < page_n)
@@ -760,7 +1659,7 @@ void outname(int n, char (*desc)[64], int *page, int *off)
 
 void outmark(int n, char (*desc)[256], int *page, int *off, int *level)
 {
-	int *objs = malloc(n * sizeof(objs[0]));
+	int *objs = calloc(n, sizeof(objs[0]));
 	int i, j;
 	int cnt = 0;
 	/* allocating objects */
@@ -769,7 +1668,7 @@ void outmark(int n, char (*desc)[256], int *page, int *off, int *level)
 		objs[i] = obj_map();
 	o_flush();
 	/* root object */
-	obj_beg(pdf_outline);
+	obj_beg(pdf_outline, 0);
 	pdfout("<<\n");
 	for (i = 0; i < n; i++)
 		if (level[i] == level[0])
@@ -787,7 +1686,7 @@ void outmark(int n, char (*desc)[256], int *page, int *off, int *level)
 		for (j = i + 1; j < n && level[j] > level[i]; j++)
 			if (level[j] == level[i] + 1)
 				cnt++;
-		obj_beg(objs[i]);
+		obj_beg(objs[i], 0);
 		pdfout("<<\n");
 		pdfout("  /Title %s\n", pdftext_static(desc[i]));
 		/* the parent field */
@@ -840,62 +1739,334 @@ void outset(char *var, char *val)
 		pdf_linecap = atoi(val);
 	if (!strcmp("linejoin", var))
 		pdf_linejoin = atoi(val);
+	if (!strcmp("cff", var))
+		pdf_cff = atoi(val);
+	if (!strcmp("stream", var))
+		pdf_stream = atoi(val);
+	if (!strcmp("objstm", var))
+		pdf_objstm = atoi(val);
+	/* for testing only: the offsets written are wrong unless the
+	 * output is appended to a file of this size */
+	if (!strcmp("offset", var))
+		pdf_base = atoll(val);
+}
+
+static int intcmp(void *v1, void *v2)
+{
+	return *(int *) v1 - *(int *) v2;
+}
+
+/*
+ * Page fragments
+ *
+ * Page contents are divided into fragments, which start at text lines
+ * and drawings.  A fragment that appears with the same contents, the
+ * same position, and the same graphics state in one of the previous
+ * two pages, like running headers and footers, is written as a form
+ * XObject; its later occurrences only invoke the form.
+ */
+static struct dict *f_seen[3];	/* fragments of the last three pages */
+static int f_gs[GS_N];		/* graphics state at the start of the fragment */
+static long long f_tw;		/* text state at the start of the fragment */
+static int f_gap, f_tl;
+
+static void frag_beg(void)
+{
+	int i;
+	pg_stream();
+	f_beg = sbuf_len(pg);
+	f_op = -1;
+	f_opend = -1;
+	f_bad = 0;
+	f_fonts_n = 0;
+	for (i = 0; i < GS_N; i++)
+		f_gs[i] = gs_get(i);
+	f_tw = t_w;
+	f_gap = t_gap;
+	f_tl = t_l;
+}
+
+/* the contents of the form of the current fragment */
+static void frag_cont(struct sbuf *sb)
+{
+	char *s = sbuf_buf(pg);
+	if (f_op < 0) {
+		sbuf_mem(sb, s + f_beg, sbuf_len(pg) - f_beg);
+		return;
+	}
+	/* text is positioned relative to the origin */
+	sbuf_printf(sb, "BT\n");
+	sbuf_mem(sb, s + f_beg, f_op - f_beg);
+	sbuf_printf(sb, "%d %d Td\n", f_h, pdf_vh - f_v);
+	sbuf_mem(sb, s + f_opend, sbuf_len(pg) - f_opend);
+	sbuf_printf(sb, "ET\n");
+}
+
+/* the form XObject of the current fragment */
+static int frag_form(struct sbuf *cont)
+{
+	struct sbuf *sb = sbuf_make();
+	int fonts[LEN(f_fonts) + 1];
+	int n = f_fonts_n;
+	int i, id;
+	memcpy(fonts, f_fonts, n * sizeof(fonts[0]));
+	if (f_gs[GS_FONT] >= 0)
+		fonts[n++] = f_gs[GS_FONT];
+	qsort(fonts, n, sizeof(fonts[0]), (void *) intcmp);
+	sbuf_printf(sb, "<<\n");
+	sbuf_printf(sb, "  /Type /XObject\n");
+	sbuf_printf(sb, "  /Subtype /Form\n");
+	sbuf_printf(sb, "  /BBox [0 0 %d %d]\n", (pdf_width * dev_res + 71) / 72, pdf_vh);
+	sbuf_printf(sb, "  /Resources << /Font <<");
+	for (i = 0; i < n; i++)
+		if (!i || fonts[i] != fonts[i - 1])
+			sbuf_printf(sb, " /F%d %d 0 R", fonts[i], pfonts[fonts[i]].obj);
+	sbuf_printf(sb, " >> >>\n");
+	pdfimg_data(sb, cont);
+	id = obj_shared(sb, 1);
+	sbuf_free(sb);
+	return id;
+}
+
+/* finish the current fragment and start a new one */
+static void frag_end(void)
+{
+	struct sbuf *sb;
+	char key[64];
+	int id, i;
+	/* only fragments longer than a form invocation */
+	if (f_bad || f_fonts_n > LEN(f_fonts) || sbuf_len(pg) - f_beg < 96) {
+		frag_beg();
+		return;
+	}
+	sb = sbuf_make();
+	for (i = 0; i < GS_N; i++)
+		sbuf_printf(sb, "%d ", f_gs[i]);
+	sbuf_printf(sb, "%lld %d\n", f_tw, f_gap);
+	frag_cont(sb);
+	pdf_digest(key, sbuf_buf(sb), sbuf_len(sb));
+	id = dict_get(pdf_fragmap, key);
+	if (id < 0 && (dict_get(f_seen[(page_n + 1) % 3], key) >= 0 ||
+			dict_get(f_seen[(page_n + 2) % 3], key) >= 0)) {
+		sbuf_cut(sb, 0);
+		frag_cont(sb);
+		id = frag_form(sb);
+		dict_put(pdf_fragmap, key, id);
+	}
+	sbuf_free(sb);
+	if (id < 0) {
+		dict_put(f_seen[page_n % 3], key, 0);
+		frag_beg();
+		return;
+	}
+	sbuf_cut(pg, f_beg);
+	sbuf_printf(pg, "ET /FO%d Do BT\n", xobj_page(id));
+	/* the form does not change the state */
+	for (i = 0; i < GS_N; i++)
+		gs_set(i, f_gs[i]);
+	t_w = f_tw;
+	t_gap = f_gap;
+	t_l = f_tl;
+	o_textbeg();
+	frag_beg();
 }
 
 void outpage(void)
 {
 	o_v = 0;
 	o_h = 0;
-	p_i = 0;
 	p_v = 0;
-	p_h = 0;
-	p_s = 0;
-	p_f = 0;
-	p_m = 0;
+	p_x = 0;
 	o_i = -1;
+	/* the initial state of pages */
+	gs_reset();
+	gs_set(GS_FILL, 0);
+	gs_set(GS_STROKE, 0);
+	gs_set(GS_LCAP, 0);
+	gs_set(GS_LJOIN, 0);
+	frag_beg();
 }
 
 void outmnt(int f)
 {
-	if (p_f == f)
-		p_f = -1;
 }
 
 void outgname(int g)
 {
 }
 
+/*
+ * Consecutive drawings with the same state are collected into one path,
+ * which is stroked or filled when something else is written.
+ */
+static struct sbuf *d_path;	/* the path of the current drawing */
+static struct sbuf *d_rel;	/* the same path relative to its first point */
+static int d_bbox[4];		/* the bounding box of d_rel in hundredths */
+static int d_h[5], d_v[5], d_n;	/* the first vertices of the current drawing */
+static int d_curve;		/* the current drawing has curves */
+static int d_run;		/* pending path: 'S' (stroke) or 'f' (rectangle fill) */
+
+static void drawpt(void)
+{
+	if (d_n < LEN(d_h)) {
+		d_h[d_n] = o_h;
+		d_v[d_n] = o_v;
+	}
+	d_n++;
+}
+
+/* append a point to the current drawing; h and v are multiplied by 100 */
+static void drawxy(long long h, long long v, char *op)
+{
+	int x = h - d_h[0] * 100;
+	int y = d_v[0] * 100 - v;
+	sbuf_dec(d_path, h, 100);
+	sbuf_chr(d_path, ' ');
+	sbuf_dec(d_path, (long long) pdf_vh * 100 - v, 100);
+	sbuf_str(d_path, op);
+	sbuf_dec(d_rel, x, 100);
+	sbuf_chr(d_rel, ' ');
+	sbuf_dec(d_rel, y, 100);
+	sbuf_str(d_rel, op);
+	d_bbox[0] = MIN(d_bbox[0], x);
+	d_bbox[1] = MIN(d_bbox[1], y);
+	d_bbox[2] = MAX(d_bbox[2], x);
+	d_bbox[3] = MAX(d_bbox[3], y);
+}
+
+static void drawflush(void)
+{
+	if (d_run) {
+		sbuf_chr(pg, d_run);
+		sbuf_chr(pg, '\n');
+	}
+	d_run = 0;
+}
+
+/* an axis-aligned rectangle; returns zero if the drawing is not one */
+static int drawrect(int *h, int *v, int *hwid, int *vwid)
+{
+	int n = d_n;
+	if (n == 5 && d_h[4] == d_h[0] && d_v[4] == d_v[0])
+		n = 4;
+	if (n != 4 || d_curve || d_h[0] == d_h[2] || d_v[0] == d_v[2])
+		return 0;
+	if (!(d_h[0] == d_h[1] && d_v[1] == d_v[2] && d_h[2] == d_h[3] && d_v[3] == d_v[0]) &&
+			!(d_v[0] == d_v[1] && d_h[1] == d_h[2] && d_v[2] == d_v[3] && d_h[3] == d_h[0]))
+		return 0;
+	*h = MIN(d_h[0], d_h[2]);
+	*v = MAX(d_v[0], d_v[2]);
+	*hwid = abs(d_h[2] - d_h[0]);
+	*vwid = abs(d_v[2] - d_v[0]);
+	return 1;
+}
+
+/*
+ * Long drawings are written as form XObjects when they appear again
+ * at another position; returns the form object or -1.
+ */
+static int drawform(int close, int fill)
+{
+	struct sbuf *sb, *cont;
+	char key[64];
+	/* a margin for line joins, in basic units */
+	int pad = (long long) pdf_linewid * o_s * dev_res / 72000 * 5 + 1;
+	int id = -1;
+	cont = sbuf_make();
+	sbuf_mem(cont, sbuf_buf(d_rel), sbuf_len(d_rel));
+	sbuf_str(cont, fill ? "f" : (close ? "s" : "S"));
+	sb = sbuf_make();
+	sbuf_printf(sb, "<<\n");
+	sbuf_printf(sb, "  /Type /XObject\n");
+	sbuf_printf(sb, "  /Subtype /Form\n");
+	sbuf_printf(sb, "  /BBox [%d %d %d %d]\n",
+		d_bbox[0] / 100 - pad, d_bbox[1] / 100 - pad,
+		d_bbox[2] / 100 + pad, d_bbox[3] / 100 + pad);
+	pdfimg_data(sb, cont);
+	pdf_digest(key, sbuf_buf(sb), sbuf_len(sb));
+	if (dict_get(pdf_drawmap, key) >= 0)
+		id = obj_shared(sb, 1);
+	else
+		dict_put(pdf_drawmap, key, 0);
+	sbuf_free(cont);
+	sbuf_free(sb);
+	return id;
+}
+
+/* check if drawing requires changing the graphics state */
+static int drawstate(int fill)
+{
+	if (fill)
+		return gs_get(GS_FILL) != o_m;
+	return gs_get(GS_STROKE) != o_m || gs_get(GS_LWID) != pdf_linewid * o_s ||
+		gs_get(GS_LCAP) != pdf_linecap || gs_get(GS_LJOIN) != pdf_linejoin;
+}
+
 void drawbeg(void)
 {
 	o_flush();
-	out_fontup();
-	sbuf_printf(pg, "%s m\n", pdfpos(o_h, o_v));
+	if (!d_run)
+		frag_end();
+	if (!d_path) {
+		d_path = sbuf_make();
+		d_rel = sbuf_make();
+	}
+	sbuf_cut(d_path, 0);
+	sbuf_cut(d_rel, 0);
+	memset(d_bbox, 0, sizeof(d_bbox));
+	d_n = 0;
+	d_curve = 0;
+	drawpt();
+	drawxy(o_h * 100, o_v * 100, " m\n");
 }
 
-static int l_page, l_size, l_wid, l_cap, l_join;	/* drawing line properties */
-
 void drawend(int close, int fill)
 {
-	fill = !fill ? 2 : fill;
-	if (l_page != page_n || l_size != o_s || l_wid != pdf_linewid ||
-			l_cap != pdf_linecap || l_join != pdf_linejoin) {
-		int lwid = pdf_linewid * o_s;
-		sbuf_printf(pg, "%d.%03d w\n", lwid / 1000, lwid % 1000);
-		sbuf_printf(pg, "%d J %d j\n", pdf_linecap, pdf_linejoin);
-		l_page = page_n;
-		l_size = o_s;
-		l_wid = pdf_linewid;
-		l_cap = pdf_linecap;
-		l_join = pdf_linejoin;
-	}
-	if (fill & 2)				/* stroking color */
-		sbuf_printf(pg, "%s RG\n", pdfcolor(o_m));
-	if (fill & 1)
-		sbuf_printf(pg, (fill & 2) ? "b\n" : "f\n");
+	int h, v, hwid, vwid;
+	int rect = (close || fill) && drawrect(&h, &v, &hwid, &vwid);
+	/* non-rectangular fills are not merged to keep their winding */
+	int kind = fill ? (rect ? 'f' : 'F') : 'S';
+	int form = !rect && sbuf_len(d_path) > 96 ? drawform(close, fill) : -1;
+	if (d_run != kind || form >= 0 || drawstate(fill))
+		drawflush();
+	if (fill && gs_set(GS_FILL, o_m))
+		pdfcolor(pg, o_m, " rg\n");
+	if (!fill && gs_set(GS_LWID, pdf_linewid * o_s)) {
+		sbuf_dec(pg, (long long) pdf_linewid * o_s * dev_res, 72000);
+		sbuf_str(pg, " w\n");
+	}
+	if (!fill && gs_set(GS_LCAP, pdf_linecap))
+		sbuf_printf(pg, "%d J\n", pdf_linecap);
+	if (!fill && gs_set(GS_LJOIN, pdf_linejoin))
+		sbuf_printf(pg, "%d j\n", pdf_linejoin);
+	if (!fill && gs_set(GS_STROKE, o_m))
+		pdfcolor(pg, o_m, " RG\n");
+	if (form >= 0) {
+		sbuf_str(pg, "ET q 1 0 0 1 ");
+		pdfpos(pg, d_h[0], d_v[0]);
+		sbuf_printf(pg, " cm /FO%d Do Q BT\n", xobj_page(form));
+		o_textbeg();
+		return;
+	}
+	if (rect) {
+		pdfpos(pg, h, v);
+		sbuf_chr(pg, ' ');
+		sbuf_int(pg, hwid);
+		sbuf_chr(pg, ' ');
+		sbuf_int(pg, vwid);
+		sbuf_str(pg, " re\n");
+	} else {
+		sbuf_mem(pg, sbuf_buf(d_path), sbuf_len(d_path));
+	}
+	if (!rect && close && !fill)
+		sbuf_str(pg, "h\n");
+	if (kind == 'F')
+		sbuf_str(pg, "f\n");
 	else
-		sbuf_printf(pg, close ? "s\n" : "S\n");
+		d_run = kind;
 	p_v = 0;
-	p_h = 0;
+	p_x = 0;
+	pg_stream();
 }
 
 void drawmbeg(char *s)
@@ -909,7 +2080,8 @@ void drawmend(char *s)
 void drawl(int h, int v)
 {
 	outrel(h, v);
-	sbuf_printf(pg, "%s l\n", pdfpos(o_h, o_v));
+	drawpt();
+	drawxy(o_h * 100, o_v * 100, " l\n");
 }
 
 /* draw circle/ellipse quadrant */
@@ -930,9 +2102,10 @@ static void drawquad(int ch, int cv)
 		x2 = x3;
 		y2 = y3 - cv * b / 1000 / 2;
 	}
-	sbuf_printf(pg, "%s ", pdfpos00(x1 / 10, y1 / 10));
-	sbuf_printf(pg, "%s ", pdfpos00(x2 / 10, y2 / 10));
-	sbuf_printf(pg, "%s c\n", pdfpos00(x3 / 10, y3 / 10));
+	drawxy(x1 / 10, y1 / 10, " ");
+	drawxy(x2 / 10, y2 / 10, " ");
+	drawxy(x3 / 10, y3 / 10, " c\n");
+	d_curve = 1;
 	outrel(ch / 2, cv / 2);
 }
 
@@ -972,33 +2145,120 @@ void draws(int h1, int v1, int h2, int v2)
 	int x2 = x1 + h2;
 	int y2 = y1 + v2;
 
-	sbuf_printf(pg, "%s ", pdfpos((x0 + 5 * x1) / 6, (y0 + 5 * y1) / 6));
-	sbuf_printf(pg, "%s ", pdfpos((x2 + 5 * x1) / 6, (y2 + 5 * y1) / 6));
-	sbuf_printf(pg, "%s c\n", pdfpos((x1 + x2) / 2, (y1 + y2) / 2));
+	drawxy((x0 + 5 * x1) / 6 * 100, (y0 + 5 * y1) / 6 * 100, " ");
+	drawxy((x2 + 5 * x1) / 6 * 100, (y2 + 5 * y1) / 6 * 100, " ");
+	drawxy((x1 + x2) / 2 * 100, (y1 + y2) / 2 * 100, " c\n");
+	d_curve = 1;
 
 	outrel(h1, v1);
 }
 
 void docheader(char *title, int pagewidth, int pageheight, int linewidth)
 {
+	int i;
 	if (title)
 		outinfo("Title", title);
 	obj_map();
 	pdf_root = obj_map();
 	pdf_pages = obj_map();
+	pdf_fontfile = dict_make(-1, 1, 0);
+	pdf_fontdesc = dict_make(-1, 1, 0);
+	pdf_objs = dict_make(-1, 1, 0);
+	pdf_xobjs = dict_make(-1, 1, 0);
+	pdf_docmap = dict_make(-1, 1, 0);
+	pdf_imgmap = dict_make(-1, 1, 0);
+	pdf_drawmap = dict_make(-1, 1, 0);
+	pdf_fragmap = dict_make(-1, 1, 0);
+	for (i = 0; i < LEN(f_seen); i++)
+		f_seen[i] = dict_make(-1, 1, 0);
+	if (pdf_objstm) {
+		obj_body = sbuf_make();
+		ostm_hdr = sbuf_make();
+		ostm_dat = sbuf_make();
+	}
+	pdf_pos = pdf_base;
 	pdfout("%%PDF-1.6\n\n");
 	pdf_width = (pagewidth * 72 + 127) / 254;
 	pdf_height = (pageheight * 72 + 127) / 254;
+	pdf_vh = (pdf_height * dev_res + 71) / 72;
 	pdf_linewid = linewidth;
 }
 
+/* write the xref table and the trailer; returns the offset of the table */
+static long long xref_table(int info_id)
+{
+	long long xref_off = pdf_pos;
+	int i;
+	pdfout("xref\n");
+	pdfout("0 %d\n", obj_n);
+	pdfout("0000000000 65535 f \n");
+	for (i = 1; i < obj_n; i++) {
+		char ent[] = "0000000000 00000 n \n";
+		long long off = obj_off[i];
+		int j;
+		for (j = 9; j >= 0 && off; j--, off /= 10)
+			ent[j] = '0' + off % 10;
+		pdfmem(ent, 20);
+	}
+	pdfout("trailer\n");
+	pdfout("<<\n");
+	pdfout("  /Size %d\n", obj_n);
+	pdfout("  /Root %d 0 R\n", pdf_root);
+	pdfout("  /Info %d 0 R\n", info_id);
+	pdfout(">>\n");
+	return xref_off;
+}
+
+/* write a cross-reference stream; returns its offset */
+static long long xref_stream(int info_id)
+{
+	struct sbuf *sb = sbuf_make();
+	struct sbuf *dat = sbuf_make();
+	int id = obj_map();
+	long long xref_off = pdf_pos;
+	int w = 1;		/* the width of offsets in bytes */
+	int i, j;
+	while (w < 8 && xref_off >> (w * 8))
+		w++;
+	obj_off[id] = xref_off;
+	for (i = 0; i < obj_n; i++) {
+		/* free (0), uncompressed (1), or compressed (2) objects */
+		int type = i == 0 ? 0 : (obj_stm[i] ? 2 : 1);
+		long long f2 = type == 2 ? obj_stm[i] : (type == 1 ? obj_off[i] : 0);
+		int f3 = type == 2 ? obj_off[i] : (type == 1 ? 0 : 65535);
+		sbuf_chr(sb, type);
+		for (j = w - 1; j >= 0; j--)
+			sbuf_chr(sb, (f2 >> (j * 8)) & 0xff);
+		sbuf_chr(sb, f3 >> 8);
+		sbuf_chr(sb, f3 & 0xff);
+	}
+	flate_deflate(sbuf_buf(sb), sbuf_len(sb), dat);
+	obj_head(id);
+	pdfout("<<\n");
+	pdfout("  /Type /XRef\n");
+	pdfout("  /Size %d\n", obj_n);
+	pdfout("  /W [1 %d 2]\n", w);
+	pdfout("  /Root %d 0 R\n", pdf_root);
+	pdfout("  /Info %d 0 R\n", info_id);
+	pdfout("  /Filter /FlateDecode\n");
+	pdfout("  /Length %d\n", sbuf_len(dat));
+	pdfout(">>\n");
+	pdfout("stream\n");
+	pdfmem(sbuf_buf(dat), sbuf_len(dat));
+	pdfout("\nendstream\n");
+	pdfout("endobj\n\n");
+	sbuf_free(sb);
+	sbuf_free(dat);
+	return xref_off;
+}
+
 void doctrailer(int pages)
 {
 	int i;
-	int xref_off;
+	long long xref_off;
 	int info_id;
 	/* pdf pages object */
-	obj_beg(pdf_pages);
+	obj_beg(pdf_pages, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /Pages\n");
 	pdfout("  /MediaBox [ 0 0 %d %d ]\n", pdf_width, pdf_height);
@@ -1010,7 +2270,7 @@ void doctrailer(int pages)
 	pdfout(">>\n");
 	obj_end();
 	/* pdf root object */
-	obj_beg(pdf_root);
+	obj_beg(pdf_root, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /Catalog\n");
 	pdfout("  /Pages %d 0 R\n", pdf_pages);
@@ -1022,8 +2282,34 @@ void doctrailer(int pages)
 	obj_end();
 	/* fonts */
 	pfont_done();
+	dict_free(pdf_fontfile);
+	dict_free(pdf_fontdesc);
+	dict_free(pdf_objs);
+	dict_free(pdf_xobjs);
+	dict_free(pdf_docmap);
+	for (i = 0; i < pdocs_n; i++) {
+		if (pdocs[i].pdf)
+			pdf_close(pdocs[i].pdf);
+		free(pdocs[i].ids);
+		free(pdocs[i].todo);
+	}
+	free(pdocs);
+	dict_free(pdf_imgmap);
+	free(pimgs);
+	free(o_fonts);
+	free(xobj);
+	free(xobj_idx);
+	free(ann);
+	if (d_path) {
+		sbuf_free(d_path);
+		sbuf_free(d_rel);
+	}
+	dict_free(pdf_drawmap);
+	dict_free(pdf_fragmap);
+	for (i = 0; i < LEN(f_seen); i++)
+		dict_free(f_seen[i]);
 	/* info object */
-	info_id = obj_beg(0);
+	info_id = obj_beg(0, 0);
 	pdfout("<<\n");
 	if (pdf_title[0])
 		pdfout("  /Title %s\n", pdftext_static(pdf_title));
@@ -1033,77 +2319,112 @@ void doctrailer(int pages)
 	pdfout("  /Producer (Neatpost)\n");
 	pdfout(">>\n");
 	obj_end();
-	/* the xref */
-	xref_off = pdf_pos;
-	pdfout("xref\n");
-	pdfout("0 %d\n", obj_n);
-	pdfout("0000000000 65535 f \n");
-	for (i = 1; i < obj_n; i++)
-		pdfout("%010d 00000 n \n", obj_off[i]);
-	/* the trailer */
-	pdfout("trailer\n");
-	pdfout("<<\n");
-	pdfout("  /Size %d\n", obj_n);
-	pdfout("  /Root %d 0 R\n", pdf_root);
-	pdfout("  /Info %d 0 R\n", info_id);
-	pdfout(">>\n");
+	if (pdf_objstm) {
+		ostm_flush();
+		xref_off = xref_stream(info_id);
+		sbuf_free(obj_body);
+		sbuf_free(ostm_hdr);
+		sbuf_free(ostm_dat);
+	} else if (pdf_pos > 9999999999ll) {
+		/* xref table offsets are limited to ten digits */
+		xref_off = xref_stream(info_id);
+	} else {
+		xref_off = xref_table(info_id);
+	}
 	pdfout("startxref\n");
-	pdfout("%d\n", xref_off);
+	pdfout("%lld\n", xref_off);
 	pdfout("%%%%EOF\n");
 	free(page_id);
 	free(obj_off);
+	free(obj_stm);
+	free(pg_ids);
 }
 
 void docpagebeg(int n)
 {
 	pg = sbuf_make();
+	/* page contents use basic units */
+	sbuf_dec(pg, 72, dev_res);
+	sbuf_str(pg, " 0 0 ");
+	sbuf_dec(pg, 72, dev_res);
+	sbuf_str(pg, " 0 ");
+	sbuf_dec(pg, (long long) pdf_height * dev_res - (long long) pdf_vh * 72, dev_res);
+	sbuf_str(pg, " cm\n");
 	sbuf_printf(pg, "BT\n");
+	o_textbeg();
+	t_l = 0;
+	t_w = 0;
+	t_gap = 0;
+	dict_free(f_seen[page_n % 3]);
+	f_seen[page_n % 3] = dict_make(-1, 1, 0);
+}
+
+/* the resource dictionary of the current page; shared among pages */
+static int pageres(void)
+{
+	struct sbuf *sb = sbuf_make();
+	int id, i;
+	/* sorting fonts to make the dictionary independent of their order */
+	qsort(o_fonts, o_fonts_n, sizeof(o_fonts[0]), (void *) intcmp);
+	sbuf_printf(sb, "<<\n");
+	sbuf_printf(sb, "  /Font <<");
+	for (i = 0; i < o_fonts_n; i++)
+		sbuf_printf(sb, " /F%d %d 0 R", o_fonts[i], pfonts[o_fonts[i]].obj);
+	sbuf_printf(sb, " >>\n");
+	if (xobj_n) {				/* XObjects */
+		sbuf_printf(sb, "  /XObject <<");
+		for (i = 0; i < xobj_n; i++)
+			sbuf_printf(sb, " /FO%d %d 0 R", i, xobj[i]);
+		sbuf_printf(sb, " >>\n");
+	}
+	sbuf_printf(sb, ">>\n");
+	id = obj_shared(sb, 0);
+	sbuf_free(sb);
+	return id;
 }
 
 void docpageend(int n)
 {
-	int cont_id;
+	int cont_id, res_id;
 	int i;
 	o_flush();
+	drawflush();
+	frag_end();
 	sbuf_printf(pg, "ET\n");
 	/* page contents */
-	cont_id = obj_beg(0);
-	pdfout("<<\n");
-	pdfout("  /Length %d\n", sbuf_len(pg) - 1);
-	pdfout(">>\n");
-	pdfout("stream\n");
-	pdfmem(sbuf_buf(pg), sbuf_len(pg));
-	pdfout("endstream\n");
-	obj_end();
+	if (pg_n) {
+		cont_id = -1;
+		pg_flush();
+	} else {
+		cont_id = obj_beg(0, 1);
+		pdfout("<<\n");
+		pdfout("  /Length %d\n", sbuf_len(pg) - 1);
+		pdfout(">>\n");
+		pdfout("stream\n");
+		pdfmem(sbuf_buf(pg), sbuf_len(pg));
+		pdfout("endstream\n");
+		obj_end();
+	}
+	res_id = pageres();
 	/* the page object */
 	if (page_n == page_sz) {
 		page_sz += 1024;
 		page_id = mextend(page_id, page_n, page_sz, sizeof(page_id[0]));
 	}
-	page_id[page_n++] = obj_beg(0);
+	page_id[page_n++] = obj_beg(0, 0);
 	pdfout("<<\n");
 	pdfout("  /Type /Page\n");
 	pdfout("  /Parent %d 0 R\n", pdf_pages);
-	pdfout("  /Resources <<\n");
-	pdfout("    /Font <<");
-	for (i = 0; i < pfonts_n; i++) {
-		if (o_iset[i]) {
-			struct pfont *ps = &pfonts[i];
-			if (ps->cid)
-				pdfout(" /%s %d 0 R", ps->name, ps->obj);
-			else
-				pdfout(" /%s.%d %d 0 R", ps->name, ps->sub, ps->obj);
-		}
-	}
-	pdfout(" >>\n");
-	if (xobj_n) {				/* XObjects */
-		pdfout("    /XObject <<");
-		for (i = 0; i < xobj_n; i++)
-			pdfout(" /FO%d %d 0 R", i, xobj[i]);
-		pdfout(" >>\n");
+	pdfout("  /Resources %d 0 R\n", res_id);
+	if (pg_n) {
+		pdfout("  /Contents [");
+		for (i = 0; i < pg_n; i++)
+			pdfout(" %d 0 R", pg_ids[i]);
+		pdfout(" ]\n");
+		pg_n = 0;
+	} else {
+		pdfout("  /Contents %d 0 R\n", cont_id);
 	}
-	pdfout("  >>\n");
-	pdfout("  /Contents %d 0 R\n", cont_id);
 	if (ann_n) {
 		pdfout("  /Annots [");
 		for (i = 0; i < ann_n; i++)
@@ -1113,7 +2434,9 @@ void docpageend(int n)
 	pdfout(">>\n");
 	obj_end();
 	sbuf_free(pg);
-	memset(o_iset, 0, pfonts_n * sizeof(o_iset[0]));
+	for (i = 0; i < xobj_n; i++)
+		xobj_idx[xobj[i]] = 0;
+	o_fonts_n = 0;
 	xobj_n = 0;
 	ann_n = 0;
 }
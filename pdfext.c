@@ -1,16 +1,26 @@
 /* Parse and extract PDF objects */
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "post.h"
 
-/* the number white space characters */
+/* the number white space characters, including comments */
 int pdf_ws(char *pdf, int len, int pos)
 {
 	int i = pos;
-	while (i < len && isspace((unsigned char) pdf[i]))
-		i++;
+	while (i < len && (isspace((unsigned char) pdf[i]) || pdf[i] == '%')) {
+		if (pdf[i] == '%')
+			while (i < len && pdf[i] != '\n' && pdf[i] != '\r')
+				i++;
+		else
+			i++;
+	}
 	return i - pos;
 }
 
@@ -18,11 +28,13 @@ int pdf_ws(char *pdf, int len, int pos)
 int pdf_type(char *pdf, int len, int pos)
 {
 	pos += pdf_ws(pdf, len, pos);
+	if (pos >= len)
+		return -1;
 	if (pdf[pos] == '/')
 		return '/';
 	if (pdf[pos] == '(')
 		return 's';
-	if (pdf[pos] == '<' && pdf[pos + 1] != '<')
+	if (pdf[pos] == '<' && (pos + 1 >= len || pdf[pos + 1] != '<'))
 		return 's';
 	if (pdf[pos] == '<' && pdf[pos + 1] == '<')
 		return 'd';
@@ -34,7 +46,7 @@ int pdf_type(char *pdf, int len, int pos)
 		while (pos < len && isdigit((unsigned char) pdf[pos]))
 			pos++;
 		pos += pdf_ws(pdf, len, pos);
-		if (!isdigit((unsigned char) pdf[pos]))
+		if (pos >= len || !isdigit((unsigned char) pdf[pos]))
 			return 'n';
 		while (pos < len && isdigit((unsigned char) pdf[pos]))
 			pos++;
@@ -44,15 +56,11 @@ int pdf_type(char *pdf, int len, int pos)
 	return -1;
 }
 
-/* the length of a pdf object */
-int pdf_len(char *pdf, int len, int pos)
+/* the length of a token other than container delimiters */
+static int pdf_toklen(char *pdf, int len, int pos)
 {
-	int c;
 	int old = pos;
-	if (pos >= len)
-		return 0;
-	pos += pdf_ws(pdf, len, pos);
-	c = (unsigned char) pdf[pos];
+	int c = (unsigned char) pdf[pos];
 	if (strchr("0123456789+-.", c)) {
 		if (pdf_type(pdf, len, pos) == 'r') {
 			char *r = memchr(pdf + pos, 'R', len - pos);
@@ -61,8 +69,7 @@ int pdf_len(char *pdf, int len, int pos)
 		pos++;
 		while (pos < len && strchr("0123456789.", (unsigned char) pdf[pos]))
 			pos++;
-	}
-	if (c == '(') {
+	} else if (c == '(') {
 		int depth = 1;
 		pos++;
 		while (pos < len && depth > 0) {
@@ -74,39 +81,102 @@ int pdf_len(char *pdf, int len, int pos)
 				pos++;
 			pos++;
 		}
-	}
-	if (c == '<' && pos + 1 < len && pdf[pos + 1] == '<') {
-		pos += 2;
-		while (pos + 2 < len && (pdf[pos] != '>' || pdf[pos + 1] != '>')) {
-			pos += pdf_len(pdf, len, pos);
-			pos += pdf_len(pdf, len, pos);
-			pos += pdf_ws(pdf, len, pos);
-		}
-		if (pos + 2 < len)
-			pos += 2;
 	} else if (c == '<') {
 		while (pos < len && pdf[pos] != '>')
 			pos++;
 		if (pos < len)
 			pos++;
-	}
-	if (c == '/') {
+	} else if (c == '/') {
 		pos++;
 		while (pos < len && !strchr(" \t\r\n\f()<>[]{}/%",
 					(unsigned char) pdf[pos]))
 			pos++;
+	} else if (!strchr("()<>[]{}", c)) {
+		/* keywords: true, false, null, ... */
+		while (pos < len && !isspace((unsigned char) pdf[pos]) &&
+				!strchr("()<>[]{}/%", (unsigned char) pdf[pos]))
+			pos++;
 	}
-	if (c == '[') {
-		pos++;
-		while (pos < len && pdf[pos] != ']') {
-			pos += pdf_len(pdf, len, pos);
-			pos += pdf_ws(pdf, len, pos);
+	return pos - old;
+}
+
+/* the length of a pdf object; nested containers are not recursed */
+int pdf_len(char *pdf, int len, int pos)
+{
+	int old = pos;
+	int depth = 0;
+	int n;
+	if (pos >= len)
+		return 0;
+	pos += pdf_ws(pdf, len, pos);
+	while (pos < len) {
+		if (pdf[pos] == '<' && pos + 1 < len && pdf[pos + 1] == '<') {
+			depth++;
+			pos += 2;
+		} else if (pdf[pos] == '[') {
+			depth++;
+			pos++;
+		} else if (depth > 0 && pdf[pos] == '>' && pos + 1 < len && pdf[pos + 1] == '>') {
+			depth--;
+			pos += 2;
+		} else if (depth > 0 && pdf[pos] == ']') {
+			depth--;
+			pos++;
+		} else {
+			n = pdf_toklen(pdf, len, pos);
+			if (n == 0 && depth == 0)
+				break;
+			pos += n ? n : 1;
 		}
-		pos++;
+		if (depth == 0)
+			break;
+		pos += pdf_ws(pdf, len, pos);
 	}
 	return pos - old;
 }
 
+/*
+ * the positions of the items of a dictionary or a list
+ *
+ * For dictionaries, keys and values alternate in items.  Returns the
+ * number of items.  *items points to buf, if its sz entries suffice,
+ * or is allocated and should be freed by the caller.
+ */
+int pdf_span(char *pdf, int len, int pos, int **items, int *buf, int sz)
+{
+	int n = 0;
+	int end;
+	*items = buf;
+	pos += pdf_ws(pdf, len, pos);
+	if (pos >= len)
+		return 0;
+	if (pdf[pos] == '[')
+		pos++;
+	else if (pdf[pos] == '<' && pos + 1 < len && pdf[pos + 1] == '<')
+		pos += 2;
+	else
+		return 0;
+	while (1) {
+		pos += pdf_ws(pdf, len, pos);
+		if (pos >= len || pdf[pos] == ']' || pdf[pos] == '>')
+			break;
+		if (!(end = pdf_len(pdf, len, pos)))
+			break;
+		if (n == sz) {
+			int *ext = malloc((sz * 2 + 64) * sizeof(ext[0]));
+			if (n)
+				memcpy(ext, *items, n * sizeof(ext[0]));
+			if (*items != buf)
+				free(*items);
+			*items = ext;
+			sz = sz * 2 + 64;
+		}
+		(*items)[n++] = pos;
+		pos += end;
+	}
+	return n;
+}
+
 static int startswith(char *s, char *t)
 {
 	while (*s && *t)
@@ -126,163 +196,539 @@ int pdf_obj(char *pdf, int len, int pos, int *obj, int *rev)
 	return 0;
 }
 
-/* the value of a pdf dictionary key */
-int pdf_dval(char *pdf, int len, int pos, char *key)
+/* the value of key in the dictionary items returned by pdf_span() */
+int pdf_dget(char *pdf, int len, int *items, int n, char *key)
 {
-	pos += 2;
-	while (pos + 2 < len && (pdf[pos] != '>' || pdf[pos + 1] != '>')) {
-		pos += pdf_ws(pdf, len, pos);
-		if (pdf_len(pdf, len, pos) == strlen(key) && startswith(key, pdf + pos)) {
-			pos += pdf_len(pdf, len, pos);
-			pos += pdf_ws(pdf, len, pos);
-			return pos;
-		}
-		pos += pdf_len(pdf, len, pos);
-		pos += pdf_len(pdf, len, pos);
-		pos += pdf_ws(pdf, len, pos);
-	}
+	int klen = strlen(key);
+	int i;
+	for (i = 0; i + 1 < n; i += 2)
+		if (pdf_len(pdf, len, items[i]) == klen && startswith(key, pdf + items[i]))
+			return items[i + 1];
 	return -1;
 }
 
-/* return a dictionary key */
-int pdf_dkey(char *pdf, int len, int pos, int key)
+/* the value of a pdf dictionary key */
+int pdf_dval(char *pdf, int len, int pos, char *key)
 {
-	int i = 0;
-	pos += 2;
-	while (pos + 2 < len && (pdf[pos] != '>' || pdf[pos + 1] != '>')) {
-		pos += pdf_ws(pdf, len, pos);
-		if (i++ == key)
-			return pos;
-		pos += pdf_len(pdf, len, pos);
-		pos += pdf_len(pdf, len, pos);
-		pos += pdf_ws(pdf, len, pos);
-	}
-	return -1;
+	int buf[64];
+	int *items;
+	int val, n;
+	if (pdf_type(pdf, len, pos) != 'd')
+		return -1;
+	n = pdf_span(pdf, len, pos, &items, buf, LEN(buf));
+	val = pdf_dget(pdf, len, items, n, key);
+	if (items != buf)
+		free(items);
+	return val;
 }
 
 /* return a list entry */
 int pdf_lval(char *pdf, int len, int pos, int idx)
 {
-	int i = 0;
-	pos++;
-	while (pos < len && pdf[pos] != ']') {
-		if (i++ == idx)
-			return pos;
-		pos += pdf_len(pdf, len, pos);
-		pos += pdf_ws(pdf, len, pos);
+	int buf[64];
+	int *items;
+	int val = -1;
+	int n;
+	if (idx < 0 || pdf_type(pdf, len, pos) != 'l')
+		return -1;
+	n = pdf_span(pdf, len, pos, &items, buf, LEN(buf));
+	if (idx < n)
+		val = items[idx];
+	if (items != buf)
+		free(items);
+	return val;
+}
+
+/* parsed PDF documents */
+struct pdf {
+	char *buf;		/* the mapped file, followed by decoded object streams */
+	int len;		/* the length of buf */
+	int map_len;		/* file size */
+	int ext_beg;		/* the position of decoded object streams in buf */
+	int buf_sz;		/* the size of the memory reserved for buf */
+	char *stms;		/* object streams already decoded */
+	int *off;		/* object offsets; -1 if missing */
+	int *gen;		/* object generation numbers; see pdf_xrefput() */
+	int n;			/* number of objects */
+	int trailer;		/* the position of the trailer dictionary */
+};
+
+char *pdf_data(struct pdf *doc)
+{
+	return doc->buf;
+}
+
+int pdf_size(struct pdf *doc)
+{
+	return doc->len;
+}
+
+/* read a non-negative integer; returns -1 on failure or overflow */
+static int pdf_num(char *pdf, int len, int *pos)
+{
+	long long n = 0;
+	*pos += pdf_ws(pdf, len, *pos);
+	if (*pos >= len || !isdigit((unsigned char) pdf[*pos]))
+		return -1;
+	while (*pos < len && isdigit((unsigned char) pdf[*pos])) {
+		if (n <= INT_MAX)
+			n = n * 10 + pdf[*pos] - '0';
+		(*pos)++;
 	}
-	return -1;
+	return n <= INT_MAX ? n : -1;
 }
 
-static void *my_memrchr(void *m, int c, long n)
+/* check if the keyword kwd appears at pos; skip it if so */
+static int pdf_kwd(char *pdf, int len, int *pos, char *kwd)
 {
-	int i;
-	for (i = 0; i < n; i++)
-		if (*(unsigned char *) (m + n - 1 - i) == c)
-			return m + n - 1 - i;
-	return NULL;
+	int n = strlen(kwd);
+	*pos += pdf_ws(pdf, len, *pos);
+	if (*pos + n > len || memcmp(pdf + *pos, kwd, n))
+		return 1;
+	*pos += n;
+	return 0;
+}
+
+/* check if the name at pos is name */
+static int pdf_isname(char *pdf, int len, int pos, char *name)
+{
+	pos += pdf_ws(pdf, len, pos);
+	return pdf_len(pdf, len, pos) == strlen(name) && startswith(name, pdf + pos);
 }
 
-static int prevline(char *pdf, int len, int off)
+/* read the number at val, a dictionary value; def if missing (-1) or invalid */
+static int pdf_vnum(char *pdf, int len, int val, int def)
 {
-	char *nl = my_memrchr(pdf, '\n', off);
-	if (nl && nl > pdf) {
-		char *nl2 = my_memrchr(pdf, '\n', nl - pdf - 1);
-		if (nl2)
-			return nl2 - pdf + 1;
+	int n = val >= 0 ? pdf_num(pdf, len, &val) : -1;
+	return n >= 0 ? n : def;
+}
+
+/*
+ * decode the stream of the object at pos into sb
+ *
+ * Only the FlateDecode filter, optionally with PNG predictors, is
+ * supported.  Returns nonzero on errors.
+ */
+static int pdf_stream(struct pdf *doc, int pos, struct sbuf *sb)
+{
+	char *pdf = doc->buf;
+	int buf[64];
+	int *items;
+	int n = pdf_span(pdf, doc->len, pos, &items, buf, LEN(buf));
+	int val = pdf_dget_val(doc, items, n, "/Length");
+	int filter = pdf_dget_val(doc, items, n, "/Filter");
+	int parms = pdf_dget_val(doc, items, n, "/DecodeParms");
+	int len = doc->len;	/* after the lookups, which may decode object streams */
+	int slen, beg;
+	if (items != buf)
+		free(items);
+	if (val < 0)
+		return 1;
+	slen = pdf_num(pdf, len, &val);
+	beg = pos + pdf_len(pdf, len, pos);
+	if (pdf_kwd(pdf, len, &beg, "stream"))
+		return 1;
+	if (beg < len && pdf[beg] == '\r')
+		beg++;
+	if (beg < len && pdf[beg] == '\n')
+		beg++;
+	if (slen < 0 || beg + slen > len)
+		return 1;
+	if (filter >= 0 && pdf_type(pdf, len, filter) == 'l') {
+		if (pdf_lval(pdf, len, filter, 1) >= 0)
+			return 1;
+		filter = pdf_lval(pdf, len, filter, 0);
+		if (parms >= 0 && pdf_type(pdf, len, parms) == 'l')
+			parms = pdf_lval(pdf, len, parms, 0);
 	}
-	return -1;
+	if (filter < 0) {
+		sbuf_mem(sb, pdf + beg, slen);
+		return 0;
+	}
+	if (!pdf_isname(pdf, len, filter, "/FlateDecode"))
+		return 1;
+	/* the output may not exceed the memory reserved for buf */
+	if (flate_inflate(pdf + beg, slen, sb, doc->buf_sz - doc->ext_beg))
+		return 1;
+	if (parms >= 0 && pdf_type(pdf, len, parms) == 'd') {
+		int pred, cols, colors, bpc, bpp;
+		n = pdf_span(pdf, len, parms, &items, buf, LEN(buf));
+		pred = pdf_vnum(pdf, len, pdf_dget(pdf, len, items, n, "/Predictor"), 1);
+		cols = pdf_vnum(pdf, len, pdf_dget(pdf, len, items, n, "/Columns"), 1);
+		colors = pdf_vnum(pdf, len, pdf_dget(pdf, len, items, n, "/Colors"), 1);
+		bpc = pdf_vnum(pdf, len, pdf_dget(pdf, len, items, n, "/BitsPerComponent"), 8);
+		if (items != buf)
+			free(items);
+		bpp = colors * bpc / 8;
+		if (pred >= 10)
+			return flate_unpredict(sb, (cols * colors * bpc + 7) / 8, bpp > 0 ? bpp : 1);
+	}
+	return 0;
 }
 
-static int nextline(char *pdf, int len, int off)
+/*
+ * add an object to the xref index, unless a newer entry exists
+ *
+ * For objects stored in object streams, off is the number of the
+ * object stream and gen is -2 minus the index of the object in it;
+ * after decoding the stream, gen becomes -1 and off points to the
+ * object in buf.
+ */
+static void pdf_xrefput(struct pdf *doc, int obj, int off, int gen)
 {
-	char *nl = memchr(pdf + off, '\n', len - off);
-	if (nl)
-		return nl - pdf + 1;
-	return -1;
+	/* object numbers from damaged or hostile files */
+	if (obj < 0 || obj >= doc->map_len)
+		return;
+	if (obj >= doc->n) {
+		int n = obj + 1024;
+		int i;
+		doc->off = mextend(doc->off, doc->n, n, sizeof(doc->off[0]));
+		doc->gen = mextend(doc->gen, doc->n, n, sizeof(doc->gen[0]));
+		for (i = doc->n; i < n; i++)
+			doc->off[i] = -1;
+		doc->n = n;
+	}
+	if (doc->off[obj] == -1) {
+		doc->off[obj] = off;
+		doc->gen[obj] = gen;
+	}
 }
 
-/* the position of the trailer */
-int pdf_trailer(char *pdf, int len)
+/* read the xref table at pos; returns the position of its trailer */
+static int pdf_xreftab(struct pdf *doc, int pos)
 {
-	int pos = prevline(pdf, len, len);		/* %%EOF */
-	while (!startswith(pdf + pos, "trailer"))
-		if ((pos = prevline(pdf, len, pos)) < 0)
+	char *pdf = doc->buf;
+	int len = doc->len;
+	int beg, cnt, off, gen, cur;
+	int size = 0;
+	int i, j;
+	/* the first pass finds the trailer to read its /Size */
+	for (j = 0; j < 2; j++) {
+		cur = pos;
+		if (pdf_kwd(pdf, len, &cur, "xref"))
+			return -1;
+		while ((beg = pdf_num(pdf, len, &cur)) >= 0) {
+			if ((cnt = pdf_num(pdf, len, &cur)) < 0)
+				return -1;
+			for (i = 0; i < cnt; i++) {
+				off = pdf_num(pdf, len, &cur);
+				gen = pdf_num(pdf, len, &cur);
+				cur += pdf_ws(pdf, len, cur);
+				if (off < 0 || gen < 0 || cur >= len)
+					return -1;
+				if (j && pdf[cur] == 'n' && i < size - beg)
+					pdf_xrefput(doc, beg + i, off, gen);
+				cur++;
+			}
+		}
+		if (pdf_kwd(pdf, len, &cur, "trailer"))
 			return -1;
-	return nextline(pdf, len, pos);			/* skip trailer\n */
+		cur += pdf_ws(pdf, len, cur);
+		size = pdf_vnum(pdf, len, pdf_dval(pdf, len, cur, "/Size"), doc->map_len);
+	}
+	return cur;
 }
 
-/* the position of the last xref table */
-static int pdf_xref(char *pdf, int len)
+/* read the xref stream at pos; returns the position of its dictionary */
+static int pdf_xrefstm(struct pdf *doc, int pos)
 {
-	int pos = prevline(pdf, len, len);		/* %%EOF */
-	if ((pos = prevline(pdf, len, pos)) < 0)
+	char *pdf = doc->buf;
+	int len = doc->len;
+	struct sbuf *sb;
+	unsigned char *s;
+	int w[3];
+	unsigned long long f[3];
+	int buf[64];
+	int *items, *idx = NULL;
+	int val, beg, cnt, size, nitems, nidx = 0;
+	int i, j, k, n;
+	if (pdf_num(pdf, len, &pos) < 0 || pdf_num(pdf, len, &pos) < 0)
+		return -1;
+	if (pdf_kwd(pdf, len, &pos, "obj"))
 		return -1;
-	/* read startxref offset */
-	if (sscanf(pdf + pos, "%d", &pos) != 1 || pos >= len || pos < 0)
+	pos += pdf_ws(pdf, len, pos);
+	if (pdf_type(pdf, len, pos) != 'd')
+		return -1;
+	nitems = pdf_span(pdf, len, pos, &items, buf, LEN(buf));
+	val = pdf_dget(pdf, len, items, nitems, "/Type");
+	if (val < 0 || !pdf_isname(pdf, len, val, "/XRef"))
+		val = -1;
+	else
+		val = pdf_dget(pdf, len, items, nitems, "/W");
+	for (i = 0; i < 3 && val >= 0; i++) {
+		int wval = pdf_lval(pdf, len, val, i);
+		if (wval < 0 || (w[i] = pdf_num(pdf, len, &wval)) < 0 || w[i] > 8)
+			val = -1;
+	}
+	size = pdf_vnum(pdf, len, pdf_dget(pdf, len, items, nitems, "/Size"), doc->map_len);
+	beg = pdf_dget(pdf, len, items, nitems, "/Index");
+	if (items != buf)
+		free(items);
+	if (val < 0)
+		return -1;
+	sb = sbuf_make();
+	if (pdf_stream(doc, pos, sb)) {
+		sbuf_free(sb);
 		return -1;
-	return nextline(pdf, len, pos);			/* skip xref\n */
+	}
+	if (beg >= 0)
+		nidx = pdf_span(pdf, len, beg, &idx, NULL, 0);
+	s = (void *) sbuf_buf(sb);
+	n = sbuf_len(sb) / (w[0] + w[1] + w[2] > 0 ? w[0] + w[1] + w[2] : 1);
+	for (i = 0, k = 0; ; i++) {
+		beg = 0;
+		cnt = size;
+		if (idx) {
+			int b, c;
+			if (i * 2 + 1 >= nidx)
+				break;
+			b = idx[i * 2];
+			c = idx[i * 2 + 1];
+			beg = pdf_num(pdf, len, &b);
+			cnt = pdf_num(pdf, len, &c);
+		} else if (i > 0) {
+			break;
+		}
+		for (j = 0; j < cnt && k < n && beg >= 0; j++, k++) {
+			int fld;
+			for (fld = 0; fld < 3; fld++) {
+				int b;
+				f[fld] = fld == 0 && !w[0] ? 1 : 0;
+				for (b = 0; b < w[fld]; b++)
+					f[fld] = (f[fld] << 8) | *s++;
+			}
+			/* offsets that cannot be in a file smaller than INT_MAX */
+			if (f[1] > INT_MAX || f[2] > INT_MAX || j >= size - beg)
+				continue;
+			if (f[0] == 1)
+				pdf_xrefput(doc, beg + j, f[1], f[2]);
+			if (f[0] == 2)
+				pdf_xrefput(doc, beg + j, f[1], -2 - (int) f[2]);
+		}
+	}
+	free(idx);
+	sbuf_free(sb);
+	return pos;
 }
 
-/* find a pdf object */
-int pdf_find(char *pdf, int len, int obj, int rev)
+/*
+ * decode object stream stm
+ *
+ * The decoded stream is appended to buf, in the memory reserved after
+ * the mapped file, so that the compressed objects can be located and
+ * parsed like other objects.  Object streams are decoded when one of
+ * their objects is first looked up.
+ */
+static void pdf_objstm(struct pdf *doc, int stm)
+{
+	struct sbuf *sb;
+	int buf[64];
+	int *items;
+	int pos, cnt, first, hdr, beg;
+	int i, n;
+	/* object streams are not themselves in object streams */
+	if (stm < 0 || stm >= doc->n || doc->gen[stm] < 0 || doc->stms[stm])
+		return;
+	doc->stms[stm] = 1;
+	sb = sbuf_make();
+	if ((pos = pdf_find(doc, stm, doc->gen[stm])) < 0 || pdf_stream(doc, pos, sb)) {
+		sbuf_free(sb);
+		return;
+	}
+	beg = doc->len > doc->ext_beg ? doc->len : doc->ext_beg;
+	if (sbuf_len(sb) >= doc->buf_sz - beg) {
+		sbuf_free(sb);
+		return;
+	}
+	memcpy(doc->buf + beg, sbuf_buf(sb), sbuf_len(sb));
+	doc->buf[beg + sbuf_len(sb)] = '\n';
+	doc->len = beg + sbuf_len(sb) + 1;
+	n = pdf_span(doc->buf, doc->len, pos, &items, buf, LEN(buf));
+	cnt = pdf_vnum(doc->buf, doc->len, pdf_dget(doc->buf, doc->len, items, n, "/N"), 0);
+	first = pdf_vnum(doc->buf, doc->len, pdf_dget(doc->buf, doc->len, items, n, "/First"), 0);
+	if (items != buf)
+		free(items);
+	hdr = 0;
+	for (i = 0; i < cnt; i++) {
+		int obj = pdf_num(sbuf_buf(sb), sbuf_len(sb), &hdr);
+		int off = pdf_num(sbuf_buf(sb), sbuf_len(sb), &hdr);
+		if (obj < 0 || off < 0 || first + off >= sbuf_len(sb))
+			break;
+		if (obj < doc->n && doc->off[obj] == stm && doc->gen[obj] == -2 - i) {
+			doc->off[obj] = beg + first + off;
+			doc->gen[obj] = -1;
+		}
+	}
+	sbuf_free(sb);
+}
+
+/* the offset of the last xref section, following startxref */
+static int pdf_startxref(char *pdf, int len)
 {
-	int obj_beg, obj_cnt;
-	int cur_rev, cur_pos;
-	char *beg;
+	int pos = len > 1024 ? len - 1024 : 0;
+	int xref = -1;
+	for (; pos + 9 < len; pos++)
+		if (pdf[pos] == 's' && !memcmp(pdf + pos, "startxref", 9))
+			xref = pos + 9;
+	if (xref >= 0)
+		xref = pdf_num(pdf, len, &xref);
+	return xref < len ? xref : -1;
+}
+
+/* index the objects of a PDF document */
+static int pdf_index(struct pdf *doc)
+{
+	int pos = pdf_startxref(doc->buf, doc->len);
+	int trailer, prev, stm;
 	int i;
-	int pos = pdf_xref(pdf, len);
-	if (pos < 0)
-		return -1;
-	/* the numbers after xref */
-	while (pos < len && sscanf(pdf + pos, "%d %d", &obj_beg, &obj_cnt) == 2) {
-		for (i = 0; i < obj_cnt; i++) {
-			if ((pos = nextline(pdf, len, pos)) < 0)
-				return -1;
-			if (sscanf(pdf + pos, "%d %d", &cur_pos, &cur_rev) != 2)
-				return -1;
-			if (obj_beg + i == obj && cur_rev == rev) {
-				if (cur_pos < 0 || cur_pos >= len)
-					return -1;
-				if (!(beg = strstr(pdf + cur_pos, "obj")))
-					return -1;
-				pos = beg - pdf + 3;
-				pos += pdf_ws(pdf, len, pos);
-				return pos;
-			}
+	/* follow /Prev links of incrementally updated files */
+	for (i = 0; i < 64 && pos >= 0; i++) {
+		if ((trailer = pdf_xreftab(doc, pos)) < 0 &&
+				(trailer = pdf_xrefstm(doc, pos)) < 0) {
+			if (i == 0)
+				return 1;
+			break;
 		}
+		if (i == 0)
+			doc->trailer = trailer;
+		/* the xref streams of hybrid-reference files */
+		stm = pdf_dval(doc->buf, doc->len, trailer, "/XRefStm");
+		if (stm >= 0 && (stm = pdf_num(doc->buf, doc->len, &stm)) >= 0)
+			pdf_xrefstm(doc, stm);
+		prev = pdf_dval(doc->buf, doc->len, trailer, "/Prev");
+		pos = prev >= 0 ? pdf_num(doc->buf, doc->len, &prev) : -1;
 	}
-	return -1;
+	doc->stms = calloc(doc->n + 1, 1);
+	return 0;
+}
+
+/* open and index a PDF file */
+struct pdf *pdf_open(char *path)
+{
+	struct pdf *doc;
+	struct stat st;
+	long long ext, sz;
+	long pg = sysconf(_SC_PAGESIZE);
+	char *buf;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size <= 0 || st.st_size >= INT_MAX / 2) {
+		close(fd);
+		return NULL;
+	}
+	/*
+	 * Decoded object streams follow the file in buf.  The memory after
+	 * the mapped file is reserved; only its used pages are allocated.
+	 * Its size limits the data decoded from the file.
+	 */
+	ext = (st.st_size + pg - 1) / pg * pg;
+	sz = ext + (st.st_size * 16 > (1 << 24) ? st.st_size * 16 : (1 << 24));
+	if (sz > INT_MAX)
+		sz = INT_MAX;
+	buf = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (buf == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (mmap(buf, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(buf, sz);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	doc = malloc(sizeof(*doc));
+	memset(doc, 0, sizeof(*doc));
+	doc->buf = buf;
+	doc->len = st.st_size;
+	doc->map_len = st.st_size;
+	doc->ext_beg = ext;
+	doc->buf_sz = sz;
+	if (pdf_index(doc)) {
+		pdf_close(doc);
+		return NULL;
+	}
+	return doc;
+}
+
+void pdf_close(struct pdf *doc)
+{
+	munmap(doc->buf, doc->buf_sz);
+	free(doc->stms);
+	free(doc->off);
+	free(doc->gen);
+	free(doc);
+}
+
+/* the position of the trailer dictionary */
+int pdf_trailer(struct pdf *doc)
+{
+	return doc->trailer;
+}
+
+/* find a pdf object */
+int pdf_find(struct pdf *doc, int obj, int rev)
+{
+	int pos;
+	if (obj < 0 || obj >= doc->n || doc->off[obj] < 0)
+		return -1;
+	if (doc->gen[obj] < -1)
+		pdf_objstm(doc, doc->off[obj]);
+	if (doc->off[obj] < 0)
+		return -1;
+	pos = doc->off[obj];
+	/* objects in object streams */
+	if (doc->gen[obj] < 0)
+		return doc->gen[obj] == -1 && rev == 0 ? pos + pdf_ws(doc->buf, doc->len, pos) : -1;
+	if (doc->gen[obj] != rev)
+		return -1;
+	/* skip "obj rev obj" */
+	if (pdf_num(doc->buf, doc->len, &pos) != obj)
+		return -1;
+	if (pdf_num(doc->buf, doc->len, &pos) < 0)
+		return -1;
+	if (pdf_kwd(doc->buf, doc->len, &pos, "obj"))
+		return -1;
+	return pos + pdf_ws(doc->buf, doc->len, pos);
 }
 
 /* read and dereference an indirect reference */
-int pdf_ref(char *pdf, int len, int pos)
+int pdf_ref(struct pdf *doc, int pos)
 {
 	int obj, rev;
-	if (pdf_obj(pdf, len, pos, &obj, &rev))
+	if (pdf_obj(doc->buf, doc->len, pos, &obj, &rev))
 		return -1;
-	return pdf_find(pdf, len, obj, rev);
+	return pdf_find(doc, obj, rev);
+}
+
+/* like pdf_dval_val(), for the dictionary items returned by pdf_span() */
+int pdf_dget_val(struct pdf *doc, int *items, int n, char *key)
+{
+	int val = pdf_dget(doc->buf, doc->len, items, n, key);
+	if (val < 0)
+		return -1;
+	if (pdf_type(doc->buf, doc->len, val) == 'r')
+		return pdf_ref(doc, val);
+	return val;
 }
 
 /* retrieve and dereference a dictionary entry */
-int pdf_dval_val(char *pdf, int len, int pos, char *key)
+int pdf_dval_val(struct pdf *doc, int pos, char *key)
 {
-	int val = pdf_dval(pdf, len, pos, key);
-	int val_obj, val_rev;
+	int val = pdf_dval(doc->buf, doc->len, pos, key);
 	if (val < 0)
 		return -1;
-	if (pdf_type(pdf, len, val) == 'r') {
-		pdf_obj(pdf, len, val, &val_obj, &val_rev);
-		return pdf_find(pdf, len, val_obj, val_rev);
-	}
+	if (pdf_type(doc->buf, doc->len, val) == 'r')
+		return pdf_ref(doc, val);
 	return val;
 }
 
 /* retrieve a dictionary entry, which is an indirect reference */
-int pdf_dval_obj(char *pdf, int len, int pos, char *key)
+int pdf_dval_obj(struct pdf *doc, int pos, char *key)
 {
-	int val = pdf_dval(pdf, len, pos, key);
+	int val = pdf_dval(doc->buf, doc->len, pos, key);
 	if (val < 0)
 		return -1;
-	return pdf_ref(pdf, len, val);
+	return pdf_ref(doc, val);
 }
@@ -290,7 +290,7 @@ static void postps(void)
 		out("%s\n", arg);
 	if (!strcmp("rotate", cmd))
 		outrotate(atoi(arg));
-	if (!strcmp("eps", cmd) || !strcmp("pdf", cmd)) {
+	if (!strcmp("eps", cmd) || !strcmp("pdf", cmd) || !strcmp("img", cmd)) {
 		char path[1 << 12];
 		int hwid, vwid, nspec;
 		char *spec = arg;
@@ -304,6 +304,8 @@ static void postps(void)
 			outeps(path, hwid, vwid);
 		if (path[0] && !strcmp("pdf", cmd))
 			outpdf(path, hwid, vwid);
+		if (path[0] && !strcmp("img", cmd))
+			outimg(path, hwid, vwid);
 	}
 	if (!strcmp("name", cmd)) {
 		char *spec = arg;
@@ -59,6 +59,7 @@ void outcolor(int c);
 void outrotate(int deg);
 void outeps(char *eps, int hwid, int vwid);
 void outpdf(char *pdf, int hwid, int vwid);
+void outimg(char *img, int hwid, int vwid);
 void outlink(char *dst, int hwid, int vwid);
 void outmark(int n, char (*desc)[256], int *page, int *off, int *level);
 void outname(int n, char (*desc)[64], int *page, int *off);
@@ -92,6 +93,22 @@ void docpageend(int n);
 char *clr_str(int c);
 int clr_get(char *s);
 
+/* graphics state tracking */
+#define GS_FILL		0	/* fill colour */
+#define GS_STROKE	1	/* stroke colour */
+#define GS_LWID		2	/* line width */
+#define GS_LCAP		3	/* line cap */
+#define GS_LJOIN	4	/* line join */
+#define GS_FONT		5	/* font */
+#define GS_SIZE		6	/* font size */
+#define GS_N		7
+
+void gs_reset(void);
+int gs_get(int key);
+int gs_set(int key, int val);
+void gs_save(void);
+void gs_restore(void);
+
 /* mapping integers to sets */
 struct iset *iset_make(void);
 void iset_free(struct iset *iset);
@@ -121,21 +138,56 @@ char *sbuf_done(struct sbuf *sb);
 void sbuf_free(struct sbuf *sb);
 int sbuf_len(struct sbuf *sbuf);
 void sbuf_str(struct sbuf *sbuf, char *s);
+void sbuf_int(struct sbuf *sbuf, long n);
+void sbuf_dec(struct sbuf *sbuf, long long n, long long d);
+void sbuf_hex(struct sbuf *sbuf, char *s, int len);
 void sbuf_printf(struct sbuf *sbuf, char *s, ...);
 void sbuf_chr(struct sbuf *sbuf, int c);
 void sbuf_mem(struct sbuf *sbuf, char *s, int len);
 void sbuf_cut(struct sbuf *sb, int len);
 
+/* TrueType and Type 1 fonts */
+int sfnt_face(char *ttf, int len, char *name, struct sbuf *sb);
+int cff_type1(char *t1, int len, struct sbuf *cff);
+
+/* raster images */
+struct img {
+	int w, h;		/* image dimensions in pixels */
+	int bpc;		/* bits per component */
+	int ncomp;		/* colour components: 1 (gray), 3 (RGB), or 4 (CMYK) */
+	int fmt;		/* data: 'j' (JPEG), 'p' (PNG IDAT), or 'f' (zlib-compressed samples) */
+	int inv;		/* inverted samples (Adobe CMYK JPEG files) */
+	struct sbuf *dat;	/* image data */
+	struct sbuf *alpha;	/* zlib-compressed 8-bit alpha samples, if any */
+	struct sbuf *pal;	/* the RGB palette of indexed images, if any */
+};
+
+struct img *img_open(char *path);
+void img_free(struct img *img);
+
+/* zlib compression and decompression */
+int flate_inflate(char *src, int len, struct sbuf *dst, int max);
+void flate_deflate(char *src, int len, struct sbuf *dst);
+int flate_unpredict(struct sbuf *sb, int rowlen, int bpp);
+
 /* reading PDF files */
 int pdf_ws(char *pdf, int len, int pos);
 int pdf_len(char *pdf, int len, int pos);
 int pdf_type(char *pdf, int len, int pos);
 int pdf_dval(char *pdf, int len, int pos, char *key);
-int pdf_dkey(char *pdf, int len, int pos, int key);
 int pdf_lval(char *pdf, int len, int pos, int idx);
-int pdf_trailer(char *pdf, int len);
+int pdf_span(char *pdf, int len, int pos, int **items, int *buf, int sz);
+int pdf_dget(char *pdf, int len, int *items, int n, char *key);
 int pdf_obj(char *pdf, int len, int pos, int *obj, int *rev);
-int pdf_find(char *pdf, int len, int obj, int rev);
-int pdf_ref(char *pdf, int len, int pos);
-int pdf_dval_val(char *pdf, int len, int pos, char *key);
-int pdf_dval_obj(char *pdf, int len, int pos, char *key);
+
+/* parsed PDF documents */
+struct pdf *pdf_open(char *path);
+void pdf_close(struct pdf *doc);
+char *pdf_data(struct pdf *doc);
+int pdf_size(struct pdf *doc);
+int pdf_trailer(struct pdf *doc);
+int pdf_find(struct pdf *doc, int obj, int rev);
+int pdf_ref(struct pdf *doc, int pos);
+int pdf_dval_val(struct pdf *doc, int pos, char *key);
+int pdf_dget_val(struct pdf *doc, int *items, int n, char *key);
+int pdf_dval_obj(struct pdf *doc, int pos, char *key);
@@ -10,7 +10,6 @@ static char ps_author[256];	/* document author */
 static int ps_height;		/* document height in basic units */
 static int o_f, o_s, o_m;	/* font and size */
 static int o_h, o_v;		/* current user position */
-static int p_f, p_s, p_m;	/* output postscript font */
 static int o_qtype;		/* queued character type */
 static int o_qv, o_qh, o_qend;	/* queued character position */
 static int o_rh, o_rv, o_rdeg;	/* previous rotation position and degree */
@@ -18,6 +17,8 @@ static int o_gname;		/* use glyphshow for all glyphs */
 
 static char o_fonts[FNLEN * NFONTS] = " ";
 
+static void drawflush(void);
+
 static void outvf(char *s, va_list ap)
 {
 	vfprintf(stdout, s, ap);
@@ -50,10 +51,9 @@ void outpage(void)
 	o_flush();
 	o_v = 0;
 	o_h = 0;
-	p_s = 0;
-	p_f = 0;
-	p_m = 0;
 	o_rdeg = 0;
+	gs_reset();
+	gs_set(GS_FILL, 0);
 }
 
 static void o_queue(struct glyph *g)
@@ -61,19 +61,29 @@ static void o_queue(struct glyph *g)
 	int type = 1 + (g->pos <= 0 || o_gname);
 	if (o_qtype != type || o_qend != o_h || o_qv != o_v) {
 		o_flush();
+		drawflush();
 		o_qh = o_h;
 		o_qv = o_v;
 		o_qtype = type;
 		outf(type == 1 ? "(" : "[");
 	}
 	if (o_qtype == 1) {
-		if (g->pos >= ' ' && g->pos <= '~')
-			outf("%s%c", strchr("()\\", g->pos) ? "\\" : "", g->pos);
-		else
-			outf("\\%d%d%d", (g->pos >> 6) & 7,
-					(g->pos >> 3) & 7, g->pos & 7);
+		char buf[8];
+		int n = 0;
+		if (g->pos < ' ' || g->pos > '~') {
+			buf[n++] = '\\';
+			buf[n++] = '0' + ((g->pos >> 6) & 7);
+			buf[n++] = '0' + ((g->pos >> 3) & 7);
+			buf[n++] = '0' + (g->pos & 7);
+		} else {
+			if (strchr("()\\", g->pos))
+				buf[n++] = '\\';
+			buf[n++] = g->pos;
+		}
+		fwrite(buf, 1, n, stdout);
 	} else {
-		outf("/%s", g->id);
+		putchar('/');
+		fputs(g->id, stdout);
 	}
 	o_qend = o_h + font_wid(g->font, o_s, g->wid);
 }
@@ -83,6 +93,7 @@ void out(char *s, ...)
 {
 	va_list ap;
 	o_flush();
+	drawflush();
 	va_start(ap, s);
 	outvf(s, ap);
 	va_end(ap);
@@ -92,15 +103,11 @@ static void out_fontup(int fid)
 {
 	char fnname[FNLEN];
 	struct font *fn;
-	if (o_m != p_m) {
+	if (gs_set(GS_FILL, o_m))
 		out("%d %d %d rgb\n", CLR_R(o_m), CLR_G(o_m), CLR_B(o_m));
-		p_m = o_m;
-	}
-	if (fid != p_f || o_s != p_s) {
+	if (gs_set(GS_FONT, fid) | gs_set(GS_SIZE, o_s)) {
 		fn = dev_font(fid);
 		out("%d /%s f\n", o_s, font_name(fn));
-		p_f = fid;
-		p_s = o_s;
 		sprintf(fnname, " %s ", font_name(fn));
 		if (!strstr(o_fonts, fnname))
 			sprintf(strchr(o_fonts, '\0'), "%s ", font_name(fn));
@@ -146,8 +153,8 @@ void outfont(int f)
 /* a font was mounted at pos f */
 void outmnt(int f)
 {
-	if (p_f == f)
-		p_f = -1;
+	if (gs_get(GS_FONT) == f)
+		gs_set(GS_FONT, -1);
 }
 
 void outsize(int s)
@@ -165,6 +172,7 @@ void outrotate(int deg)
 {
 	o_flush();
 	out_fontup(o_f);
+	drawflush();
 	if (o_rdeg)
 		outf("%d %d %d rot\n", -o_rdeg, o_rh, o_rv);
 	o_rdeg = deg;
@@ -176,19 +184,79 @@ void outrotate(int deg)
 static int draw_path;	/* number of path segments */
 static int draw_point;	/* point was set for postscript newpath */
 
+/*
+ * Consecutive strokes with the same state are collected into one path,
+ * which is stroked when something else is written.
+ */
+static struct sbuf *d_path;	/* the path of the current drawing */
+static int d_h[5], d_v[5], d_n;	/* the first vertices of the current drawing */
+static int d_curve;		/* the current drawing has curves */
+static int d_run;		/* a stroke is pending */
+
+static void drawpt(void)
+{
+	if (d_n < LEN(d_h)) {
+		d_h[d_n] = o_h;
+		d_v[d_n] = o_v;
+	}
+	d_n++;
+}
+
+static void drawflush(void)
+{
+	if (d_run)
+		outf("stroke\n");
+	d_run = 0;
+}
+
+/* write path construction operators */
+static void drawf(char *s, ...)
+{
+	va_list ap;
+	va_start(ap, s);
+	if (draw_path) {
+		outvf(s, ap);
+	} else {
+		char buf[256];
+		vsnprintf(buf, sizeof(buf), s, ap);
+		sbuf_str(d_path, buf);
+	}
+	va_end(ap);
+}
+
 static void drawmv(void)
 {
 	if (!draw_point)
-		outf("%d %d m ", o_h, o_v);
+		drawf("%d %d m ", o_h, o_v);
 	draw_point = 1;
 }
 
+/* an axis-aligned rectangle; returns zero if the drawing is not one */
+static int drawrect(int *h, int *v, int *hwid, int *vwid)
+{
+	int n = d_n;
+	if (n == 5 && d_h[4] == d_h[0] && d_v[4] == d_v[0])
+		n = 4;
+	if (n != 4 || d_curve || d_h[0] == d_h[2] || d_v[0] == d_v[2])
+		return 0;
+	if (!(d_h[0] == d_h[1] && d_v[1] == d_v[2] && d_h[2] == d_h[3] && d_v[3] == d_v[0]) &&
+			!(d_v[0] == d_v[1] && d_h[1] == d_h[2] && d_v[2] == d_v[3] && d_h[3] == d_h[0]))
+		return 0;
+	*h = MIN(d_h[0], d_h[2]);
+	*v = MAX(d_v[0], d_v[2]);
+	*hwid = abs(d_h[2] - d_h[0]);
+	*vwid = abs(d_v[2] - d_v[0]);
+	return 1;
+}
+
 /* start a multi-segment path */
 void drawmbeg(char *s)
 {
 	o_flush();
 	out_fontup(o_f);
+	drawflush();
 	draw_path = 1;
+	gs_save();
 	outf("gsave newpath %s\n", s);
 }
 
@@ -198,6 +266,7 @@ void drawmend(char *s)
 	draw_path = 0;
 	draw_point = 0;
 	outf("%s grestore\n", s);
+	gs_restore();
 }
 
 void drawbeg(void)
@@ -206,54 +275,75 @@ void drawbeg(void)
 	out_fontup(o_f);
 	if (draw_path)
 		return;
-	outf("newpath ");
+	if (!d_path)
+		d_path = sbuf_make();
+	sbuf_cut(d_path, 0);
+	d_n = 0;
+	d_curve = 0;
+	drawpt();
 }
 
 void drawend(int close, int fill)
 {
+	int h, v, hwid, vwid;
 	if (draw_path)
 		return;
 	draw_point = 0;
+	if (fill) {
+		drawflush();
+		if (drawrect(&h, &v, &hwid, &vwid))
+			outf("%d %d %d %d rf\n", h, v, hwid, vwid);
+		else
+			outf("newpath %s%sfill\n", sbuf_buf(d_path), close ? "closepath " : "");
+		return;
+	}
+	if (!d_run)
+		outf("newpath ");
+	d_run = 1;
 	if (close)
-		outf("closepath ");
-	if (fill)
-		outf("fill\n");
-	else
-		outf("stroke\n");
+		sbuf_str(d_path, "closepath");
+	else if (sbuf_len(d_path))
+		sbuf_cut(d_path, sbuf_len(d_path) - 1);
+	outf("%s\n", sbuf_buf(d_path));
 }
 
 void drawl(int h, int v)
 {
 	drawmv();
 	outrel(h, v);
-	outf("%d %d drawl ", o_h, o_v);
+	drawpt();
+	drawf("%d %d drawl ", o_h, o_v);
 }
 
 void drawc(int c)
 {
 	drawmv();
 	outrel(c, 0);
-	outf("%d %d drawe ", c, c);
+	d_curve = 1;
+	drawf("%d %d drawe ", c, c);
 }
 
 void drawe(int h, int v)
 {
 	drawmv();
 	outrel(h, 0);
-	outf("%d %d drawe ", h, v);
+	d_curve = 1;
+	drawf("%d %d drawe ", h, v);
 }
 
 void drawa(int h1, int v1, int h2, int v2)
 {
 	drawmv();
-	outf("%d %d %d %d drawa ", h1, v1, h2, v2);
+	d_curve = 1;
+	drawf("%d %d %d %d drawa ", h1, v1, h2, v2);
 	outrel(h1 + h2, v1 + v2);
 }
 
 void draws(int h1, int v1, int h2, int v2)
 {
 	drawmv();
-	outf("%d %d %d %d %d %d draws ", o_h, o_v, o_h + h1, o_v + v1,
+	d_curve = 1;
+	drawf("%d %d %d %d %d %d draws ", o_h, o_v, o_h + h1, o_v + v1,
 		o_h + h1 + h2, o_v + v1 + v2);
 	outrel(h1, v1);
 }
@@ -294,6 +384,8 @@ void outeps(char *eps, int hwid, int vwid)
 	/* output the EPS file */
 	o_flush();
 	out_fontup(o_f);
+	drawflush();
+	gs_save();
 	outf("%d %d %d %d %d %d %d %d EPSFBEG\n",
 		llx, lly, hwid, urx - llx, vwid, ury - lly, o_h, o_v);
 	outf("%%%%BeginDocument: %s\n", eps);
@@ -303,12 +395,77 @@ void outeps(char *eps, int hwid, int vwid)
 	fclose(filp);
 	outf("%%%%EndDocument\n");
 	outf("EPSFEND\n");
+	gs_restore();
 }
 
 void outpdf(char *pdf, int hwid, int vwid)
 {
 }
 
+/* write data in hexadecimal */
+static void outhex(char *s, int n)
+{
+	struct sbuf *sb = sbuf_make();
+	int i;
+	for (i = 0; i < n; i += 64) {
+		sbuf_hex(sb, s + i, MIN(64, n - i));
+		sbuf_chr(sb, '\n');
+		if (sbuf_len(sb) >= (1 << 16) || i + 64 >= n) {
+			fwrite(sbuf_buf(sb), 1, sbuf_len(sb), stdout);
+			sbuf_cut(sb, 0);
+		}
+	}
+	sbuf_free(sb);
+}
+
+void outimg(char *path, int hwid, int vwid)
+{
+	struct img *img;
+	int i;
+	if (!(img = img_open(path)))
+		return;
+	/* the image occupies one point per pixel by default */
+	if (hwid <= 0 && vwid <= 0)
+		hwid = img->w * dev_res / 72;
+	if (vwid <= 0)
+		vwid = (long long) img->h * hwid / img->w;
+	if (hwid <= 0)
+		hwid = (long long) img->w * vwid / img->h;
+	o_flush();
+	out_fontup(o_f);
+	drawflush();
+	gs_save();
+	outf("gsave %d %d t translate %d %d scale\n", o_h, o_v, hwid, vwid);
+	if (img->pal) {
+		outf("[/Indexed /DeviceRGB %d <\n", sbuf_len(img->pal) / 3 - 1);
+		outhex(sbuf_buf(img->pal), sbuf_len(img->pal));
+		outf(">] setcolorspace\n");
+	} else {
+		outf("/%s setcolorspace\n", img->ncomp == 4 ? "DeviceCMYK" :
+			(img->ncomp == 3 ? "DeviceRGB" : "DeviceGray"));
+	}
+	outf("{ << /ImageType 1 /Width %d /Height %d /BitsPerComponent %d\n",
+		img->w, img->h, img->bpc);
+	outf("/ImageMatrix [%d 0 0 %d 0 %d] /Decode [", img->w, -img->h, img->h);
+	if (img->pal)
+		outf("0 %d", (1 << img->bpc) - 1);
+	for (i = 0; !img->pal && i < img->ncomp; i++)
+		outf(img->inv ? " 1 0" : " 0 1");
+	outf("]\n/DataSource currentfile /ASCIIHexDecode filter");
+	if (img->fmt == 'j')
+		outf(" /DCTDecode filter");
+	if (img->fmt == 'f')
+		outf(" /FlateDecode filter");
+	if (img->fmt == 'p')
+		outf(" << /Predictor 15 /Colors %d /BitsPerComponent %d /Columns %d >>"
+			" /FlateDecode filter", img->ncomp, img->bpc, img->w);
+	outf(" >> image IMGSKIP } exec\n");
+	outhex(sbuf_buf(img->dat), sbuf_len(img->dat));
+	outf(">\n%%%%EndImage\ngrestore\n");
+	gs_restore();
+	img_free(img);
+}
+
 void outlink(char *lnk, int hwid, int vwid)
 {
 	o_flush();
@@ -433,6 +590,7 @@ static char *prolog =
 	"/w {neg moveto show} bind def\n"
 	"/m {neg moveto} bind def\n"
 	"/g {neg moveto {glyphshow} forall} bind def\n"
+	"/rf {4 -2 roll neg 4 2 roll rectfill} bind def\n"
 	"/rgb {255 div 3 1 roll 255 div 3 1 roll 255 div 3 1 roll setrgbcolor} bind def\n"
 	"/rot {/y exch def /x exch def x y neg translate rotate x neg y translate} bind def\n"
 	"/done {/lastpage where {pop lastpage} if} def\n"
@@ -501,6 +659,10 @@ static char *prolog =
 	"	count op_count sub {pop} repeat\n"
 	"	countdictstack dict_count sub {end} repeat\n"
 	"	epsf_state restore\n"
+	"} bind def\n"
+	"% including raster images; skip the data not read by image\n"
+	"/IMGSKIP {\n"
+	"	{ currentfile 256 string readline pop (%%EndImage) eq { exit } if } loop\n"
 	"} bind def\n";
 
 /* pagewidth and pageheight are in tenths of a millimetre */
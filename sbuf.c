@@ -68,6 +68,60 @@ void sbuf_mem(struct sbuf *sbuf, char *s, int len)
 	sbuf->s_n += len;
 }
 
+/* append the decimal representation of n */
+void sbuf_int(struct sbuf *sbuf, long n)
+{
+	char buf[32];
+	char *s = buf + sizeof(buf);
+	unsigned long u = n < 0 ? -(unsigned long) n : n;
+	do {
+		*--s = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (n < 0)
+		*--s = '-';
+	sbuf_mem(sbuf, s, buf + sizeof(buf) - s);
+}
+
+/* append n / d with at most six decimal digits */
+void sbuf_dec(struct sbuf *sbuf, long long n, long long d)
+{
+	char buf[32];
+	char *s = buf;
+	long long f;
+	int i;
+	if (n < 0)
+		sbuf_chr(sbuf, '-');
+	n = n < 0 ? -n : n;
+	f = (n % d * 1000000 + d / 2) / d;
+	sbuf_int(sbuf, n / d + f / 1000000);
+	f %= 1000000;
+	if (f) {
+		*s++ = '.';
+		for (i = 100000; i && f; i /= 10) {
+			*s++ = '0' + f / i;
+			f %= i;
+		}
+		sbuf_mem(sbuf, buf, s - buf);
+	}
+}
+
+/* append the lowercase hexadecimal digits of the bytes of s */
+void sbuf_hex(struct sbuf *sbuf, char *s, int len)
+{
+	static char hex[] = "0123456789abcdef";
+	char *d;
+	int i;
+	if (sbuf->s_n + len * 2 + 1 >= sbuf->s_sz)
+		sbuf_extend(sbuf, NEXTSZ(sbuf->s_sz, len * 2 + 1));
+	d = sbuf->s + sbuf->s_n;
+	for (i = 0; i < len; i++) {
+		*d++ = hex[(unsigned char) s[i] >> 4];
+		*d++ = hex[(unsigned char) s[i] & 0x0f];
+	}
+	sbuf->s_n += len * 2;
+}
+
 void sbuf_str(struct sbuf *sbuf, char *s)
 {
 	sbuf_mem(sbuf, s, strlen(s));
@@ -0,0 +1,137 @@
+/* TrueType and OpenType font files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "post.h"
+
+static unsigned sfnt_u16(char *s)
+{
+	unsigned char *u = (void *) s;
+	return (u[0] << 8) | u[1];
+}
+
+static unsigned long sfnt_u32(char *s)
+{
+	unsigned char *u = (void *) s;
+	return ((unsigned long) u[0] << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+static void sfnt_put32(char *d, unsigned long n)
+{
+	d[0] = (n >> 24) & 0xff;
+	d[1] = (n >> 16) & 0xff;
+	d[2] = (n >> 8) & 0xff;
+	d[3] = n & 0xff;
+}
+
+/* the offset and length of a table in the face starting at off */
+static int sfnt_table(char *ttf, int len, int off, char *tag, int *tlen)
+{
+	int ntab, i;
+	if (off < 0 || off + 12 > len)
+		return -1;
+	ntab = sfnt_u16(ttf + off + 4);
+	if (off + 12 + ntab * 16 > len)
+		return -1;
+	for (i = 0; i < ntab; i++) {
+		char *rec = ttf + off + 12 + i * 16;
+		if (!memcmp(rec, tag, 4)) {
+			int toff = sfnt_u32(rec + 8);
+			*tlen = sfnt_u32(rec + 12);
+			if (toff < 0 || *tlen < 0 || toff + *tlen > len)
+				return -1;
+			return toff;
+		}
+	}
+	return -1;
+}
+
+/* check if the PostScript name of the face at off is name */
+static int sfnt_hasname(char *ttf, int len, int off, char *name)
+{
+	int nlen = strlen(name);
+	int tlen, cnt, str;
+	int i, j;
+	int tab = sfnt_table(ttf, len, off, "name", &tlen);
+	if (tab < 0 || tlen < 6)
+		return 0;
+	cnt = sfnt_u16(ttf + tab + 2);
+	str = tab + sfnt_u16(ttf + tab + 4);
+	for (i = 0; i < cnt && 6 + i * 12 + 12 <= tlen; i++) {
+		char *rec = ttf + tab + 6 + i * 12;
+		int plat = sfnt_u16(rec);
+		int slen = sfnt_u16(rec + 8);
+		char *s = ttf + str + sfnt_u16(rec + 10);
+		if (sfnt_u16(rec + 6) != 6 || s + slen > ttf + len)
+			continue;
+		if (plat == 1 && slen == nlen && !memcmp(s, name, nlen))
+			return 1;
+		if ((plat == 0 || plat == 3) && slen == nlen * 2) {
+			for (j = 0; j < nlen; j++)
+				if (s[j * 2] || s[j * 2 + 1] != name[j])
+					break;
+			if (j == nlen)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * extract a face from a TrueType collection into sb
+ *
+ * The face whose PostScript name matches name is selected; the
+ * first face is used if none matches.  Returns nonzero if ttf
+ * is not a collection.
+ */
+int sfnt_face(char *ttf, int len, char *name, struct sbuf *sb)
+{
+	int nfaces, off, ntab, pos;
+	int head = -1;
+	unsigned long sum = 0;
+	char *out;
+	int i;
+	if (len < 16 || memcmp(ttf, "ttcf", 4))
+		return 1;
+	nfaces = sfnt_u32(ttf + 8);
+	if (nfaces <= 0 || 12 + nfaces * 4 > len)
+		return 1;
+	off = sfnt_u32(ttf + 12);
+	for (i = 0; i < nfaces; i++) {
+		if (sfnt_hasname(ttf, len, sfnt_u32(ttf + 12 + i * 4), name)) {
+			off = sfnt_u32(ttf + 12 + i * 4);
+			break;
+		}
+	}
+	if (off < 0 || off + 12 > len)
+		return 1;
+	ntab = sfnt_u16(ttf + off + 4);
+	if (off + 12 + ntab * 16 > len)
+		return 1;
+	/* the offset table and table records */
+	sbuf_mem(sb, ttf + off, 12 + ntab * 16);
+	pos = 12 + ntab * 16;
+	for (i = 0; i < ntab; i++) {
+		char *rec = ttf + off + 12 + i * 16;
+		int toff = sfnt_u32(rec + 8);
+		int tlen = sfnt_u32(rec + 12);
+		if (toff < 0 || tlen < 0 || toff + tlen > len)
+			return 1;
+		if (!memcmp(rec, "head", 4) && tlen >= 12)
+			head = pos;
+		sfnt_put32(sbuf_buf(sb) + 12 + i * 16 + 8, pos);
+		sbuf_mem(sb, ttf + toff, tlen);
+		while (sbuf_len(sb) & 3)
+			sbuf_chr(sb, '\0');
+		pos = sbuf_len(sb);
+	}
+	/* recompute checkSumAdjustment of the head table */
+	out = sbuf_buf(sb);
+	if (head >= 0) {
+		sfnt_put32(out + head + 8, 0);
+		for (i = 0; i < sbuf_len(sb); i += 4)
+			sum += sfnt_u32(out + i);
+		sfnt_put32(out + head + 8, 0xb1b0afbaul - (sum & 0xfffffffful));
+	}
+	return 0;
+}
@@ -131,6 +131,10 @@ void outpdf(char *pdf, int hwid, int vwid)
 {
 }
 
+void outimg(char *img, int hwid, int vwid)
+{
+}
+
 void outlink(char *lnk, int hwid, int vwid)
 {
 }